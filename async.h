@@ -0,0 +1,120 @@
+#pragma once
+
+#include <coroutine>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace async {
+
+// A lazily started lookup that yields after each prefetch, as returned by
+// persistent_array::async_get. R is the iterator's reference type; references
+// are kept as pointers, values are copied out of the tree.
+template <typename R>
+class lookup {
+ public:
+  struct promise_type {
+    std::conditional_t<std::is_reference_v<R>, std::add_pointer_t<R>,
+                       std::optional<R>>
+        value{};
+
+    lookup get_return_object() {
+      return lookup{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    std::suspend_always final_suspend() noexcept { return {}; }
+
+    void return_value(R result) {
+      if constexpr (std::is_reference_v<R>) {
+        value = &result;
+      } else {
+        value.emplace(std::move(result));
+      }
+    }
+
+    void unhandled_exception() { throw; }
+  };
+
+ private:
+  std::coroutine_handle<promise_type> handle;
+
+  explicit lookup(std::coroutine_handle<promise_type> handle)
+      : handle(handle) {}
+
+  friend class scheduler;
+
+ public:
+  lookup(lookup&& other) noexcept
+      : handle(std::exchange(other.handle, nullptr)) {}
+
+  lookup& operator=(lookup&& other) noexcept {
+    std::swap(handle, other.handle);
+    return *this;
+  }
+
+  ~lookup() {
+    if (handle) {
+      handle.destroy();
+    }
+  }
+
+  // A moved-from lookup has no coroutine left to run and counts as done.
+  bool done() const { return !handle || handle.done(); }
+
+  void resume() const { handle.resume(); }
+
+  R get() const { return *handle.promise().value; }
+};
+
+// Round-robin driver for lookups: at most `width` of them are in flight, and
+// each resume moves one a level down while the others' prefetches land.
+class scheduler {
+  size_t width;
+  std::vector<std::coroutine_handle<>> pending;
+
+ public:
+  explicit scheduler(size_t width = 16) : width(width) {
+    if (width == 0) {
+      throw std::invalid_argument("async::scheduler width must be positive");
+    }
+  }
+
+  // The lookup must stay alive until run() returns. Adding it more than once
+  // is allowed; it is still resumed only until it is done.
+  template <typename R>
+  void add(const lookup<R>& lookup) {
+    pending.push_back(lookup.handle);
+  }
+
+  void run() {
+    std::vector<std::coroutine_handle<>> active;
+    size_t next = 0;
+    while (active.size() < width && next < pending.size()) {
+      active.push_back(pending[next++]);
+    }
+    while (!active.empty()) {
+      for (size_t i = 0; i < active.size();) {
+        // Finished lookups are never resumed: one added twice may be done
+        // through its other entry, and one may be done before run().
+        if (!active[i].done()) {
+          active[i].resume();
+        }
+        if (!active[i].done()) {
+          ++i;
+        } else if (next < pending.size()) {
+          active[i++] = pending[next++];
+        } else {
+          active[i] = active.back();
+          active.pop_back();
+        }
+      }
+    }
+    pending.clear();
+  }
+};
+
+}  // namespace async
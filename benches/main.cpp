@@ -26,6 +26,43 @@ BENCHMARK(StoredRandomUpdates<int, 1000, base::Initial>);
 BENCHMARK(StoredRandomUpdates<int, 1000, base::MySharedPtr>);
 BENCHMARK(StoredRandomUpdates<int, 1000, base::FourFold>);
 BENCHMARK(StoredRandomUpdates<int, 1000, base::EightFold>);
+BENCHMARK(StoredRandomUpdates<int, 1000, base::Interned>);
+BENCHMARK(StoredRandomUpdates<int, 1000, base::Packed>);
+BENCHMARK(StoredRandomUpdates<int, 1000, base::Wide>);
+
+// Tiny versions, where base::Small keeps one flat block.
+BENCHMARK(StoredRandomUpdates<int, 8, base::Initial>);
+BENCHMARK(StoredRandomUpdates<int, 8, base::MySharedPtr>);
+BENCHMARK(StoredRandomUpdates<int, 8, base::FourFold>);
+BENCHMARK(StoredRandomUpdates<int, 8, base::EightFold>);
+BENCHMARK(StoredRandomUpdates<int, 8, base::Interned>);
+BENCHMARK(StoredRandomUpdates<int, 8, base::Packed>);
+BENCHMARK(StoredRandomUpdates<int, 8, base::Wide>);
+BENCHMARK(StoredRandomUpdates<int, 8, base::Small>);
+BENCHMARK(StoredRandomUpdates<int, 16, base::Initial>);
+BENCHMARK(StoredRandomUpdates<int, 16, base::MySharedPtr>);
+BENCHMARK(StoredRandomUpdates<int, 16, base::FourFold>);
+BENCHMARK(StoredRandomUpdates<int, 16, base::EightFold>);
+BENCHMARK(StoredRandomUpdates<int, 16, base::Interned>);
+BENCHMARK(StoredRandomUpdates<int, 16, base::Packed>);
+BENCHMARK(StoredRandomUpdates<int, 16, base::Wide>);
+BENCHMARK(StoredRandomUpdates<int, 16, base::Small>);
+BENCHMARK(StoredRandomUpdates<int, 32, base::Initial>);
+BENCHMARK(StoredRandomUpdates<int, 32, base::MySharedPtr>);
+BENCHMARK(StoredRandomUpdates<int, 32, base::FourFold>);
+BENCHMARK(StoredRandomUpdates<int, 32, base::EightFold>);
+BENCHMARK(StoredRandomUpdates<int, 32, base::Interned>);
+BENCHMARK(StoredRandomUpdates<int, 32, base::Packed>);
+BENCHMARK(StoredRandomUpdates<int, 32, base::Wide>);
+BENCHMARK(StoredRandomUpdates<int, 32, base::Small>);
+BENCHMARK(StoredRandomUpdates<int, 64, base::Initial>);
+BENCHMARK(StoredRandomUpdates<int, 64, base::MySharedPtr>);
+BENCHMARK(StoredRandomUpdates<int, 64, base::FourFold>);
+BENCHMARK(StoredRandomUpdates<int, 64, base::EightFold>);
+BENCHMARK(StoredRandomUpdates<int, 64, base::Interned>);
+BENCHMARK(StoredRandomUpdates<int, 64, base::Packed>);
+BENCHMARK(StoredRandomUpdates<int, 64, base::Wide>);
+BENCHMARK(StoredRandomUpdates<int, 64, base::Small>);
 
 template <typename T, size_t N, template <typename> typename Base>
 static void CumulativeRandomUpdates(benchmark::State& state) {
@@ -46,6 +83,57 @@ BENCHMARK(CumulativeRandomUpdates<int, 1000, base::Initial>);
 BENCHMARK(CumulativeRandomUpdates<int, 1000, base::MySharedPtr>);
 BENCHMARK(CumulativeRandomUpdates<int, 1000, base::FourFold>);
 BENCHMARK(CumulativeRandomUpdates<int, 1000, base::EightFold>);
+BENCHMARK(CumulativeRandomUpdates<int, 1000, base::Interned>);
+BENCHMARK(CumulativeRandomUpdates<int, 1000, base::Packed>);
+BENCHMARK(CumulativeRandomUpdates<int, 1000, base::Wide>);
+
+// Single-owner use: every update consumes the previous version.
+template <typename T, size_t N, template <typename> typename Base>
+static void MoveRandomUpdates(benchmark::State& state) {
+  using pa_t = persistent_array<T, Base<T>>;
+
+  std::mt19937 rnd{};
+  pa_t pa(N);
+
+  for (auto _ : state) {
+    int position = rnd() % N;
+    int new_val = rnd();
+
+    pa = std::move(pa).update(position, new_val);
+  }
+}
+
+BENCHMARK(MoveRandomUpdates<int, 1000, base::Initial>);
+BENCHMARK(MoveRandomUpdates<int, 1000, base::MySharedPtr>);
+BENCHMARK(MoveRandomUpdates<int, 1000, base::FourFold>);
+BENCHMARK(MoveRandomUpdates<int, 1000, base::EightFold>);
+BENCHMARK(MoveRandomUpdates<int, 1000, base::Interned>);
+BENCHMARK(MoveRandomUpdates<int, 1000, base::Packed>);
+BENCHMARK(MoveRandomUpdates<int, 1000, base::Wide>);
+
+// Ordered-list edits: every iteration inserts one value and erases another,
+// so the size stays at N.
+template <typename T, size_t N, template <typename> typename Base>
+static void RandomInsertErase(benchmark::State& state) {
+  using pa_t = persistent_array<T, Base<T>>;
+
+  std::mt19937 rnd{};
+  pa_t pa(N);
+
+  for (auto _ : state) {
+    pa = pa.insert(rnd() % (N + 1), rnd());
+    size_t position = rnd() % (N + 1);
+    pa = pa.erase(position, position + 1);
+  }
+}
+
+BENCHMARK(RandomInsertErase<int, 1000, base::Initial>);
+BENCHMARK(RandomInsertErase<int, 1000, base::MySharedPtr>);
+BENCHMARK(RandomInsertErase<int, 1000, base::FourFold>);
+BENCHMARK(RandomInsertErase<int, 1000, base::EightFold>);
+BENCHMARK(RandomInsertErase<int, 1000, base::Interned>);
+BENCHMARK(RandomInsertErase<int, 1000, base::Packed>);
+BENCHMARK(RandomInsertErase<int, 1000, base::Wide>);
 
 template <typename T, size_t N, template <typename> typename Base>
 static void Traversal(benchmark::State& state) {
@@ -62,6 +150,7 @@ static void Traversal(benchmark::State& state) {
   for (auto _ : state) {
     auto it = pa.begin();
     for (int i = 0; i < N; ++i) {
+      benchmark::DoNotOptimize(*it);
       ++it;
     }
   }
@@ -71,6 +160,36 @@ BENCHMARK(Traversal<int, 1000, base::Initial>);
 BENCHMARK(Traversal<int, 1000, base::MySharedPtr>);
 BENCHMARK(Traversal<int, 1000, base::FourFold>);
 BENCHMARK(Traversal<int, 1000, base::EightFold>);
+BENCHMARK(Traversal<int, 1000, base::Interned>);
+BENCHMARK(Traversal<int, 1000, base::Packed>);
+BENCHMARK(Traversal<int, 1000, base::Wide>);
+
+template <typename T, size_t N, template <typename> typename Base>
+static void Export(benchmark::State& state) {
+  using pa_t = persistent_array<T, Base<T>>;
+
+  std::mt19937 rnd{};
+  pa_t pa(N);
+  for (int i = 0; i < 2 * N; ++i) {
+    int position = rnd() % N;
+    int new_val = rnd();
+    pa = pa.update(position, new_val);
+  }
+
+  std::vector<T> out(N);
+  for (auto _ : state) {
+    pa.copy_to(0, N, out.data());
+    benchmark::DoNotOptimize(out.data());
+  }
+}
+
+BENCHMARK(Export<int, 1000, base::Initial>);
+BENCHMARK(Export<int, 1000, base::MySharedPtr>);
+BENCHMARK(Export<int, 1000, base::FourFold>);
+BENCHMARK(Export<int, 1000, base::EightFold>);
+BENCHMARK(Export<int, 1000, base::Interned>);
+BENCHMARK(Export<int, 1000, base::Packed>);
+BENCHMARK(Export<int, 1000, base::Wide>);
 
 template <typename T, size_t N, template <typename> typename Base>
 static void Indexing(benchmark::State& state) {
@@ -86,7 +205,7 @@ static void Indexing(benchmark::State& state) {
 
   for (auto _ : state) {
     int position = rnd() % N;
-    pa[position];
+    benchmark::DoNotOptimize(pa[position]);
   }
 }
 
@@ -94,5 +213,139 @@ BENCHMARK(Indexing<int, 1000, base::Initial>);
 BENCHMARK(Indexing<int, 1000, base::MySharedPtr>);
 BENCHMARK(Indexing<int, 1000, base::FourFold>);
 BENCHMARK(Indexing<int, 1000, base::EightFold>);
+BENCHMARK(Indexing<int, 1000, base::Interned>);
+BENCHMARK(Indexing<int, 1000, base::Packed>);
+BENCHMARK(Indexing<int, 1000, base::Wide>);
+
+template <typename T, size_t N, template <typename> typename Base>
+static void LowerBound(benchmark::State& state) {
+  using pa_t = persistent_array<T, Base<T>>;
+
+  std::vector<T> values(N);
+  for (size_t i = 0; i < N; ++i) {
+    values[i] = 2 * i;
+  }
+  pa_t pa(values.begin(), values.end());
+
+  std::mt19937 rnd{};
+  for (auto _ : state) {
+    T key = rnd() % (2 * N);
+    benchmark::DoNotOptimize(std::lower_bound(pa.begin(), pa.end(), key));
+  }
+}
+
+BENCHMARK(LowerBound<int, 1000, base::Initial>);
+BENCHMARK(LowerBound<int, 1000, base::MySharedPtr>);
+BENCHMARK(LowerBound<int, 1000, base::FourFold>);
+BENCHMARK(LowerBound<int, 1000, base::EightFold>);
+BENCHMARK(LowerBound<int, 1000, base::Interned>);
+BENCHMARK(LowerBound<int, 1000, base::Packed>);
+BENCHMARK(LowerBound<int, 1000, base::Wide>);
+
+template <typename T, size_t N, template <typename> typename Base>
+static void NativeLowerBound(benchmark::State& state) {
+  using pa_t = persistent_array<T, Base<T>>;
+
+  std::vector<T> values(N);
+  for (size_t i = 0; i < N; ++i) {
+    values[i] = 2 * i;
+  }
+  pa_t pa(values.begin(), values.end());
+
+  std::mt19937 rnd{};
+  for (auto _ : state) {
+    T key = rnd() % (2 * N);
+    benchmark::DoNotOptimize(pa.lower_bound(key));
+  }
+}
+
+BENCHMARK(NativeLowerBound<int, 1000, base::Initial>);
+BENCHMARK(NativeLowerBound<int, 1000, base::MySharedPtr>);
+BENCHMARK(NativeLowerBound<int, 1000, base::FourFold>);
+BENCHMARK(NativeLowerBound<int, 1000, base::EightFold>);
+BENCHMARK(NativeLowerBound<int, 1000, base::Interned>);
+BENCHMARK(NativeLowerBound<int, 1000, base::Packed>);
+BENCHMARK(NativeLowerBound<int, 1000, base::Wide>);
+
+// Reads a window of W positions that slides by one, either through a reader
+// or through operator[].
+template <typename T, size_t N, template <typename> typename Base, bool Cached>
+static void SlidingWindow(benchmark::State& state) {
+  using pa_t = persistent_array<T, Base<T>>;
+  static constexpr size_t W = 8;
+
+  std::mt19937 rnd{};
+  pa_t pa(N);
+  for (int i = 0; i < 2 * N; ++i) {
+    int position = rnd() % N;
+    int new_val = rnd();
+    pa = pa.update(position, new_val);
+  }
+
+  auto reader = pa.read();
+  for (auto _ : state) {
+    for (size_t first = 0; first + W <= N; ++first) {
+      for (size_t i = first; i < first + W; ++i) {
+        if constexpr (Cached) {
+          benchmark::DoNotOptimize(reader.get(i));
+        } else {
+          benchmark::DoNotOptimize(pa[i]);
+        }
+      }
+    }
+  }
+}
+
+BENCHMARK(SlidingWindow<int, 1000, base::Initial, false>);
+BENCHMARK(SlidingWindow<int, 1000, base::MySharedPtr, false>);
+BENCHMARK(SlidingWindow<int, 1000, base::FourFold, false>);
+BENCHMARK(SlidingWindow<int, 1000, base::EightFold, false>);
+BENCHMARK(SlidingWindow<int, 1000, base::Interned, false>);
+BENCHMARK(SlidingWindow<int, 1000, base::Packed, false>);
+BENCHMARK(SlidingWindow<int, 1000, base::Wide, false>);
+BENCHMARK(SlidingWindow<int, 1000, base::Initial, true>);
+BENCHMARK(SlidingWindow<int, 1000, base::MySharedPtr, true>);
+BENCHMARK(SlidingWindow<int, 1000, base::FourFold, true>);
+BENCHMARK(SlidingWindow<int, 1000, base::EightFold, true>);
+BENCHMARK(SlidingWindow<int, 1000, base::Interned, true>);
+BENCHMARK(SlidingWindow<int, 1000, base::Packed, true>);
+BENCHMARK(SlidingWindow<int, 1000, base::Wide, true>);
+
+// Forks a version and adds one to every value of the fork, either with an
+// update per value or with one modify_range.
+template <typename T, size_t N, template <typename> typename Base, bool Ranged>
+static void TransformFork(benchmark::State& state) {
+  using pa_t = persistent_array<T, Base<T>>;
+  std::vector<T> v(N);
+  std::iota(v.begin(), v.end(), 0);
+  pa_t pa(v.begin(), v.end());
+
+  for (auto _ : state) {
+    pa_t fork = pa;
+    if constexpr (Ranged) {
+      fork = std::move(fork).modify_range(0, N, [](T& x) { x += 1; });
+    } else {
+      for (size_t i = 0; i < N; ++i) {
+        fork = std::move(fork).update(i, fork[i] + 1);
+      }
+    }
+    benchmark::DoNotOptimize(fork);
+  }
+}
+
+BENCHMARK(TransformFork<int, 1000, base::Initial, false>);
+BENCHMARK(TransformFork<int, 1000, base::MySharedPtr, false>);
+BENCHMARK(TransformFork<int, 1000, base::FourFold, false>);
+BENCHMARK(TransformFork<int, 1000, base::EightFold, false>);
+BENCHMARK(TransformFork<int, 1000, base::Interned, false>);
+BENCHMARK(TransformFork<int, 1000, base::Packed, false>);
+BENCHMARK(TransformFork<int, 1000, base::Wide, false>);
+BENCHMARK(TransformFork<int, 1000, base::Initial, true>);
+BENCHMARK(TransformFork<int, 1000, base::MySharedPtr, true>);
+BENCHMARK(TransformFork<int, 1000, base::FourFold, true>);
+BENCHMARK(TransformFork<int, 1000, base::EightFold, true>);
+BENCHMARK(TransformFork<int, 1000, base::Interned, true>);
+BENCHMARK(TransformFork<int, 1000, base::Packed, true>);
+BENCHMARK(TransformFork<int, 1000, base::Wide, true>);
 
 BENCHMARK_MAIN();
\ No newline at end of file
@@ -0,0 +1,366 @@
+// Scaling suite: sweeps array size, element size and access pattern for every
+// backend. Run with --benchmark_format=json (or --benchmark_out=<file>
+// --benchmark_out_format=json) to get results comparable across commits.
+
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <optional>
+#include <random>
+#include "persistent_array.h"
+
+// Live heap bytes requested through operator new. The size is kept in a small
+// header in front of every block, so allocator overhead is not included.
+static std::atomic<int64_t> live_bytes = 0;
+
+static constexpr size_t HEADER = alignof(std::max_align_t);
+
+void* operator new(size_t size) {
+  void* block = std::malloc(size + HEADER);
+  if (!block) {
+    throw std::bad_alloc{};
+  }
+  *static_cast<size_t*>(block) = size;
+  live_bytes.fetch_add(size, std::memory_order_relaxed);
+  return static_cast<char*>(block) + HEADER;
+}
+
+void operator delete(void* ptr) noexcept {
+  if (!ptr) {
+    return;
+  }
+  void* block = static_cast<char*>(ptr) - HEADER;
+  live_bytes.fetch_sub(*static_cast<size_t*>(block), std::memory_order_relaxed);
+  std::free(block);
+}
+
+void operator delete(void* ptr, size_t) noexcept { operator delete(ptr); }
+
+// Over-aligned nodes: the header is widened to the alignment so the block
+// still starts on an aligned address.
+void* operator new(size_t size, std::align_val_t align) {
+  size_t alignment = static_cast<size_t>(align);
+  size_t header = std::max(HEADER, alignment);
+  size_t total = (header + size + alignment - 1) / alignment * alignment;
+  void* block = std::aligned_alloc(alignment, total);
+  if (!block) {
+    throw std::bad_alloc{};
+  }
+  auto ptr = reinterpret_cast<size_t*>(static_cast<char*>(block) + header);
+  ptr[-1] = size;
+  ptr[-2] = header;
+  live_bytes.fetch_add(size, std::memory_order_relaxed);
+  return ptr;
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+  if (!ptr) {
+    return;
+  }
+  auto sizes = static_cast<size_t*>(ptr);
+  live_bytes.fetch_sub(sizes[-1], std::memory_order_relaxed);
+  std::free(static_cast<char*>(ptr) - sizes[-2]);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t align) noexcept {
+  operator delete(ptr, align);
+}
+
+// Bytes held by live nodes. Blocks parked in the node caches came from
+// operator new but hold no node, so they are subtracted.
+static int64_t node_bytes() {
+  return live_bytes - static_cast<int64_t>(base::cached_bytes);
+}
+
+template <size_t S>
+struct Blob {
+  std::array<uint32_t, S / sizeof(uint32_t)> data;
+
+  Blob() = default;
+
+  Blob(uint32_t x) { data.fill(x); }
+};
+
+enum Pattern { SEQUENTIAL, RANDOM, ZIPFIAN, HOT_SPOT };
+
+static const char* pattern_name(int64_t pattern) {
+  static const char* names[] = {"sequential", "random", "zipfian", "hot_spot"};
+  return names[pattern];
+}
+
+class Positions {
+  Pattern pattern;
+  size_t n;
+  std::mt19937_64 rnd{};
+  size_t next = 0;
+  size_t hot_begin;
+
+ public:
+  Positions(Pattern pattern, size_t n)
+      : pattern(pattern), n(n), hot_begin(rnd() % n) {}
+
+  size_t operator()() {
+    switch (pattern) {
+      case SEQUENTIAL:
+        next = next + 1 == n ? 0 : next + 1;
+        return next;
+      case RANDOM:
+        return rnd() % n;
+      case ZIPFIAN: {
+        // Log-uniform ranks approximate Zipf with s = 1; ranks are scattered
+        // over the array so that popular positions are not also neighbours.
+        double u = std::uniform_real_distribution<double>{}(rnd);
+        size_t rank = static_cast<size_t>(std::pow(n + 1.0, u)) - 1;
+        return rank * 0x9e3779b97f4a7c15ULL % n;
+      }
+      case HOT_SPOT: {
+        // 90% of the accesses go to a contiguous tenth of the array.
+        size_t hot_size = std::max<size_t>(n / 10, 1);
+        if (rnd() % 10 != 0) {
+          return (hot_begin + rnd() % hot_size) % n;
+        }
+        return rnd() % n;
+      }
+    }
+    return 0;
+  }
+};
+
+// The version under test, shared by consecutive benchmarks of the same
+// backend and size so that large arrays are only built once.
+template <typename T, template <typename> typename Base>
+static const persistent_array<T, Base<T>>& sample(size_t n,
+                                                  double& bytes_per_element) {
+  using pa_t = persistent_array<T, Base<T>>;
+  static std::optional<pa_t> pa;
+  static double bytes;
+  if (!pa || pa->size() != n) {
+    pa.reset();
+    std::mt19937 rnd{};
+    std::vector<T> values(n);
+    for (auto& value : values) {
+      value = T(rnd());
+    }
+    int64_t before = node_bytes();
+    pa.emplace(values.begin(), values.end());
+    bytes = static_cast<double>(node_bytes() - before) / n;
+  }
+  bytes_per_element = bytes;
+  return *pa;
+}
+
+template <typename T, template <typename> typename Base>
+static void Update(benchmark::State& state) {
+  size_t n = state.range(0);
+  Pattern pattern = static_cast<Pattern>(state.range(1));
+  double bytes_per_element;
+  auto pa = sample<T, Base>(n, bytes_per_element);
+  Positions positions(pattern, n);
+  std::mt19937 rnd{};
+
+  std::vector<double> latencies;
+  int64_t bytes_per_version = 0;
+  for (auto _ : state) {
+    size_t position = positions();
+    uint32_t new_val = rnd();
+
+    int64_t before = node_bytes();
+    auto start = std::chrono::steady_clock::now();
+    auto new_version = pa.update(position, new_val);
+    auto finish = std::chrono::steady_clock::now();
+    bytes_per_version += node_bytes() - before;
+
+    latencies.push_back(
+        std::chrono::duration<double, std::nano>(finish - start).count());
+    pa = std::move(new_version);
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) {
+    return latencies[std::min(latencies.size() - 1,
+                              static_cast<size_t>(p * latencies.size()))];
+  };
+  state.counters["p50_ns"] = percentile(0.5);
+  state.counters["p99_ns"] = percentile(0.99);
+  state.counters["p999_ns"] = percentile(0.999);
+  state.counters["bytes_per_version"] =
+      static_cast<double>(bytes_per_version) / latencies.size();
+  state.counters["bytes_per_element"] = bytes_per_element;
+  state.SetLabel(pattern_name(pattern));
+}
+
+template <typename T, template <typename> typename Base>
+static void Read(benchmark::State& state) {
+  size_t n = state.range(0);
+  Pattern pattern = static_cast<Pattern>(state.range(1));
+  double bytes_per_element;
+  const auto& pa = sample<T, Base>(n, bytes_per_element);
+  Positions positions(pattern, n);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(pa[positions()]);
+  }
+
+  state.SetItemsProcessed(state.iterations());
+  state.counters["bytes_per_element"] = bytes_per_element;
+  state.SetLabel(pattern_name(pattern));
+}
+
+// Batched lookups through gather(); compare items_per_second with Read.
+template <typename T, template <typename> typename Base>
+static void Gather(benchmark::State& state) {
+  const size_t BATCH = 1024;
+  size_t n = state.range(0);
+  Pattern pattern = static_cast<Pattern>(state.range(1));
+  double bytes_per_element;
+  const auto& pa = sample<T, Base>(n, bytes_per_element);
+  Positions positions(pattern, n);
+  std::vector<size_t> indices(BATCH);
+  std::vector<T> out(BATCH);
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::generate(indices.begin(), indices.end(), std::ref(positions));
+    state.ResumeTiming();
+    pa.gather(indices, out.begin());
+    benchmark::DoNotOptimize(out.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * BATCH);
+  state.SetLabel(pattern_name(pattern));
+}
+
+// The same batches through async_get() and a scheduler.
+template <typename T, template <typename> typename Base>
+static void AsyncGet(benchmark::State& state) {
+  const size_t BATCH = 1024;
+  size_t n = state.range(0);
+  Pattern pattern = static_cast<Pattern>(state.range(1));
+  double bytes_per_element;
+  const auto& pa = sample<T, Base>(n, bytes_per_element);
+  Positions positions(pattern, n);
+  std::vector<size_t> indices(BATCH);
+  std::vector<T> out(BATCH);
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::generate(indices.begin(), indices.end(), std::ref(positions));
+    state.ResumeTiming();
+    async::scheduler scheduler;
+    std::vector<decltype(pa.async_get(0))> lookups;
+    lookups.reserve(BATCH);
+    for (size_t index : indices) {
+      scheduler.add(lookups.emplace_back(pa.async_get(index)));
+    }
+    scheduler.run();
+    for (size_t i = 0; i < BATCH; ++i) {
+      out[i] = lookups[i].get();
+    }
+    benchmark::DoNotOptimize(out.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * BATCH);
+  state.SetLabel(pattern_name(pattern));
+}
+
+template <typename T, template <typename> typename Base>
+static void Scan(benchmark::State& state) {
+  size_t n = state.range(0);
+  double bytes_per_element;
+  const auto& pa = sample<T, Base>(n, bytes_per_element);
+
+  for (auto _ : state) {
+    for (auto it = pa.begin(); it != pa.end(); ++it) {
+      benchmark::DoNotOptimize(*it);
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * n);
+  state.counters["bytes_per_element"] = bytes_per_element;
+}
+
+// Whole-version export through copy_to(); compare items_per_second with Scan.
+template <typename T, template <typename> typename Base, size_t Threads>
+static void Export(benchmark::State& state) {
+  size_t n = state.range(0);
+  double bytes_per_element;
+  const auto& pa = sample<T, Base>(n, bytes_per_element);
+  std::vector<T> out(n);
+
+  for (auto _ : state) {
+    pa.copy_to(0, n, out.data(), Threads);
+    benchmark::DoNotOptimize(out.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Sizes from 1e3 to 1e8, skipping those whose raw payload exceeds 4 GiB.
+template <typename T>
+static void sizes(benchmark::internal::Benchmark* b, bool with_patterns) {
+  b->ArgNames({"n", "pattern"});
+  for (int64_t n = 1'000; n <= 100'000'000; n *= 10) {
+    if (n * sizeof(T) > (int64_t{1} << 32)) {
+      continue;
+    }
+    if (!with_patterns) {
+      b->Args({n, SEQUENTIAL});
+      continue;
+    }
+    for (int64_t pattern : {SEQUENTIAL, RANDOM, ZIPFIAN, HOT_SPOT}) {
+      b->Args({n, pattern});
+    }
+  }
+}
+
+template <typename T, template <typename> typename Base>
+static void register_backend(const std::string& backend) {
+  auto name = [&](const std::string& kind) {
+    return kind + "/" + backend + "/" + std::to_string(sizeof(T)) + "B";
+  };
+  benchmark::RegisterBenchmark(name("Update").c_str(), Update<T, Base>)
+      ->Apply([](auto* b) { sizes<T>(b, true); });
+  benchmark::RegisterBenchmark(name("Read").c_str(), Read<T, Base>)
+      ->Apply([](auto* b) { sizes<T>(b, true); });
+  benchmark::RegisterBenchmark(name("Gather").c_str(), Gather<T, Base>)
+      ->Apply([](auto* b) { sizes<T>(b, true); });
+  benchmark::RegisterBenchmark(name("AsyncGet").c_str(), AsyncGet<T, Base>)
+      ->Apply([](auto* b) { sizes<T>(b, true); });
+  benchmark::RegisterBenchmark(name("Scan").c_str(), Scan<T, Base>)
+      ->Apply([](auto* b) { sizes<T>(b, false); })
+      ->Unit(benchmark::kMillisecond);
+  benchmark::RegisterBenchmark(name("Export").c_str(), Export<T, Base, 1>)
+      ->Apply([](auto* b) { sizes<T>(b, false); })
+      ->Unit(benchmark::kMillisecond);
+  benchmark::RegisterBenchmark(name("ExportParallel").c_str(),
+                               Export<T, Base, 4>)
+      ->Apply([](auto* b) { sizes<T>(b, false); })
+      ->Unit(benchmark::kMillisecond);
+}
+
+template <typename T>
+static void register_element() {
+  register_backend<T, base::Initial>("Initial");
+  register_backend<T, base::MySharedPtr>("MySharedPtr");
+  register_backend<T, base::FourFold>("FourFold");
+  register_backend<T, base::EightFold>("EightFold");
+  register_backend<T, base::Wide>("Wide");
+}
+
+int main(int argc, char** argv) {
+  register_element<Blob<4>>();
+  register_element<Blob<16>>();
+  register_element<Blob<64>>();
+  register_element<Blob<256>>();
+  register_backend<int32_t, base::Packed>("Packed");
+  register_backend<int64_t, base::Packed>("Packed");
+
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+}
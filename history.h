@@ -0,0 +1,245 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "persistent_array.h"
+
+// Undo history over versions of an array. checkpoint() records the working
+// version, undo() and redo() move between recorded ones, and recording after
+// an undo starts a new branch next to the old one. Checkpoints share nodes,
+// so each is charged only the nodes it adds to its parent; once the charges
+// exceed the budget, the oldest checkpoints are dropped. Insert and erase
+// reshape the tree, and subtrees they move are charged again, so after them
+// the charges overstate what a checkpoint adds and checkpoints go early.
+//
+// Base must be named: persistent_array's default, base::Initial, keeps its
+// counts inside shared_ptr where the budget cannot read them.
+template <typename T, typename Base>
+class history {
+  static_assert(base::Accountable<Base>,
+                "history needs a backend with intrusive reference counts, "
+                "such as base::Auto<T>; base::Initial<T> has none");
+
+ public:
+  using array = persistent_array<T, Base>;
+
+  // What dropping checkpoints freed, bookkeeping included. Nodes still used
+  // by the remaining checkpoints or by arrays held elsewhere are not counted.
+  struct Dropped {
+    size_t checkpoints = 0;
+    size_t nodes = 0;
+    size_t bytes = 0;
+  };
+
+  explicit history(array initial,
+                   size_t budget = std::numeric_limits<size_t>::max())
+      : working(initial), budget(budget) {
+    checkpoints.push_back({std::move(initial), nullptr});
+    head = &checkpoints.back();
+    head->nodes = added(root(*head), nullptr);
+    total_nodes = head->nodes;
+  }
+
+  history(const history&) = delete;
+  history& operator=(const history&) = delete;
+
+  // The working version, which undo() and redo() replace.
+  const array& current() const { return working; }
+
+  void set(array version) { working = std::move(version); }
+
+  template <typename... Args>
+  void update(size_t index, Args&&... args) {
+    working = std::move(working).update(index, std::forward<Args>(args)...);
+  }
+
+  // Records the working version as a child of the current checkpoint. Takes
+  // time in the nodes changed since that checkpoint, not in the array size.
+  Dropped checkpoint() {
+    auto parent = head;
+    if (working.base.root_node() == root(*parent)) {
+      return {};
+    }
+    checkpoints.push_back({working, parent});
+    head = &checkpoints.back();
+    head->nodes = added(root(*head), root(*parent));
+    parent->children.push_back(head);
+    parent->redo = head;
+    total_nodes += head->nodes;
+    return trim();
+  }
+
+  // Moves to the parent checkpoint. Changes made since the last checkpoint
+  // are discarded.
+  bool undo() {
+    if (!head->parent) {
+      return false;
+    }
+    head->parent->redo = head;
+    go_to(head->parent);
+    return true;
+  }
+
+  // Moves to the child last undone from or recorded.
+  bool redo() {
+    if (!head->redo) {
+      return false;
+    }
+    go_to(head->redo);
+    return true;
+  }
+
+  // Moves to a child by position; branches are kept oldest first.
+  bool redo(size_t branch) {
+    if (branch >= head->children.size()) {
+      return false;
+    }
+    head->redo = head->children[branch];
+    go_to(head->redo);
+    return true;
+  }
+
+  size_t branches() const { return head->children.size(); }
+
+  size_t size() const { return checkpoints.size(); }
+
+  size_t nodes() const { return total_nodes; }
+
+  Dropped set_budget(size_t new_budget) {
+    budget = new_budget;
+    return trim();
+  }
+
+  // Heap bytes of a checkpoint's own bookkeeping: its list node and an array
+  // with room for the given number of children.
+  static size_t checkpoint_bytes(size_t children) {
+    return sizeof(Checkpoint) + 2 * sizeof(void*) +
+           children * sizeof(Checkpoint*);
+  }
+
+ private:
+  using Node = typename Base::BaseNode;
+
+  struct Checkpoint {
+    array version;
+    Checkpoint* parent;
+    std::vector<Checkpoint*> children = {};
+    // The child redo() moves to.
+    Checkpoint* redo = nullptr;
+    // Nodes not in the parent's version.
+    size_t nodes = 0;
+  };
+
+  // Oldest first.
+  std::list<Checkpoint> checkpoints;
+  Checkpoint* head;
+  array working;
+  size_t budget;
+  size_t total_nodes;
+
+  static const Node* root(const Checkpoint& checkpoint) {
+    return checkpoint.version.base.root_node();
+  }
+
+  void go_to(Checkpoint* checkpoint) {
+    head = checkpoint;
+    working = checkpoint->version;
+  }
+
+  Dropped trim() {
+    Dropped dropped;
+    while (total_nodes > budget && drop_oldest(dropped)) {
+    }
+    return dropped;
+  }
+
+  // Drops the oldest checkpoint that can go without splitting the tree: a
+  // leaf, or the root once it has a single child. The current one stays.
+  bool drop_oldest(Dropped& dropped) {
+    for (auto it = checkpoints.begin(); it != checkpoints.end(); ++it) {
+      auto& checkpoint = *it;
+      if (&checkpoint == head) {
+        continue;
+      }
+      if (checkpoint.children.empty()) {
+        auto parent = checkpoint.parent;
+        std::erase(parent->children, &checkpoint);
+        if (parent->redo == &checkpoint) {
+          parent->redo =
+              parent->children.empty() ? nullptr : parent->children.back();
+        }
+        total_nodes -= checkpoint.nodes;
+      } else if (!checkpoint.parent && checkpoint.children.size() == 1) {
+        auto child = checkpoint.children[0];
+        size_t only_here =
+            std::min(added(root(checkpoint), root(*child)), checkpoint.nodes);
+        child->parent = nullptr;
+        child->nodes += checkpoint.nodes - only_here;
+        total_nodes -= only_here;
+      } else {
+        continue;
+      }
+      release(root(checkpoint), dropped);
+      dropped.bytes += checkpoint_bytes(checkpoint.children.capacity());
+      checkpoints.erase(it);
+      return true;
+    }
+    return false;
+  }
+
+  // Nodes reachable from a but not from b, found by walking both trees in
+  // step and skipping the subtrees they share. Children are paired only
+  // under nodes of equal size, so a subtree that moved is counted as added.
+  static size_t added(const Node* a, const Node* b) {
+    std::unordered_set<const Node*> seen;
+    std::vector<std::pair<const Node*, const Node*>> stack = {{a, b}};
+    std::vector<const Node*> others;
+    size_t count = 0;
+    while (!stack.empty()) {
+      auto [node, other] = stack.back();
+      stack.pop_back();
+      if (!node || node == other || !seen.insert(node).second) {
+        continue;
+      }
+      count += 1;
+      others.clear();
+      if (other && other->size == node->size) {
+        Base::for_each_child(
+            other, [&](const Node* child) { others.push_back(child); });
+      }
+      size_t i = 0;
+      Base::for_each_child(node, [&](const Node* child) {
+        stack.emplace_back(child, i < others.size() ? others[i] : nullptr);
+        ++i;
+      });
+    }
+    return count;
+  }
+
+  // Counts what goes once the checkpoint lets go of root: a node goes when
+  // every reference to it is held by the checkpoint or by nodes that go.
+  static void release(const Node* root, Dropped& dropped) {
+    dropped.checkpoints += 1;
+    std::unordered_map<const Node*, size_t> references;
+    std::vector<const Node*> stack;
+    if (root) {
+      stack.push_back(root);
+    }
+    while (!stack.empty()) {
+      auto node = stack.back();
+      stack.pop_back();
+      if (++references[node] < node->ref_count) {
+        continue;
+      }
+      dropped.nodes += 1;
+      dropped.bytes += Base::node_bytes(node);
+      Base::for_each_child(node,
+                           [&](const Node* child) { stack.push_back(child); });
+    }
+  }
+};
@@ -1,15 +1,71 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <functional>
 #include <memory>
 #include <numeric>
+#include <ranges>
+#include <span>
+#include <thread>
+#include <vector>
+#include "async.h"
 #include "versions/all.h"
 
+template <typename T, typename Base>
+class history;
+
 template <typename T, typename Base = base::Initial<T>>
 class persistent_array {
   Base base;
 
+  friend class history<T, Base>;
+
   explicit persistent_array(Base base) : base(std::move(base)) {}
 
+  // Backends that can keep values in a foreign buffer use it as is; the rest
+  // move the elements into their own nodes.
+  static Base adopt(T* data, size_t count, std::shared_ptr<void> owner) {
+    if constexpr (requires { Base::adopt(data, count, owner); }) {
+      return Base::adopt(data, count, std::move(owner));
+    } else {
+      return Base::from_iter(std::make_move_iterator(data),
+                             std::make_move_iterator(data + count));
+    }
+  }
+
+  explicit persistent_array(std::shared_ptr<std::vector<T>> values)
+      : base(adopt(values->data(), values->size(), values)) {}
+
+  persistent_array(std::shared_ptr<T[]> values, size_t count)
+      : base(adopt(values.get(), count, values)) {}
+
+  // Backends that annotate their nodes find the point in one descent; the
+  // rest binary search over iterators.
+  template <typename Pred>
+  size_t partition_point(Pred pred) const {
+    if constexpr (requires { base.partition_point(pred); }) {
+      return base.partition_point(pred);
+    } else {
+      return std::partition_point(begin(), end(), pred) - begin();
+    }
+  }
+
+  // Replaces positions [first, last) with the contents of inserted. Backends
+  // without a splice of their own rebuild the whole array.
+  persistent_array splice(size_t first, size_t last,
+                          const Base& inserted) const {
+    if constexpr (requires { base.splice(first, last, inserted); }) {
+      return persistent_array{base.splice(first, last, inserted)};
+    } else {
+      std::vector<T> values(size() - (last - first) + inserted.size());
+      T* out = base.copy_to(0, first, values.data());
+      out = inserted.copy_to(0, inserted.size(), out);
+      base.copy_to(last, size(), out);
+      return persistent_array{std::move(values)};
+    }
+  }
+
  public:
   using iterator = typename Base::template BaseIterator<true>;
   using const_iterator = iterator;
@@ -36,6 +92,8 @@ class persistent_array {
 
   size_t max_size() const { return Base::MAX_SIZE; }
 
+  persistent_array() : persistent_array(std::initializer_list<T>{}) {}
+
   explicit persistent_array(size_t count) : base(Base::filled(count, T{})) {}
 
   explicit persistent_array(size_t count, const T& fill)
@@ -48,10 +106,236 @@ class persistent_array {
   explicit persistent_array(Iter first, Iter last)
       : base(Base::from_iter(first, last)) {}
 
+  // Takes over the buffer instead of copying it. With base::Wide the leaves
+  // of this version point into it, and it is freed with the last of them;
+  // other backends move the elements out.
+  explicit persistent_array(std::vector<T>&& values)
+      : persistent_array(std::make_shared<std::vector<T>>(std::move(values))) {
+  }
+
+  persistent_array(std::unique_ptr<T[]> values, size_t count)
+      : persistent_array(std::shared_ptr<T[]>(std::move(values)), count) {}
+
   template <typename... Args>
-  persistent_array update(size_t index, Args&&... args) const {
+  persistent_array update(size_t index, Args&&... args) const& {
     return persistent_array{base.update(index, std::forward<Args>(args)...)};
   }
 
-  const T& operator[](size_t i) const { return *(begin() + i); }
+  // Consumes this version, so nodes only it owns are updated in place rather
+  // than copied: pa = std::move(pa).update(i, x) costs no allocation when pa
+  // is not shared. Iterators into this version see the change. No other
+  // thread may copy or read this version meanwhile. Only base::Initial and
+  // base::Interned count owners atomically, so only with them may another
+  // thread drop a copy it holds; with the other backends no other thread may
+  // touch the version or its copies until this returns.
+  template <typename... Args>
+  persistent_array update(size_t index, Args&&... args) && {
+    return persistent_array{
+        std::move(base).update(index, std::forward<Args>(args)...)};
+  }
+
+  // Applies (index, value) pairs in order. Only the first update to reach a
+  // node copies it; later ones reuse the copy.
+  template <std::ranges::input_range Changes>
+  persistent_array update_many(Changes&& changes) const& {
+    return persistent_array{*this}.update_many(
+        std::forward<Changes>(changes));
+  }
+
+  template <std::ranges::input_range Changes>
+  persistent_array update_many(Changes&& changes) && {
+    for (auto&& [index, value] : changes) {
+      base = std::move(base).update(index, value);
+    }
+    return std::move(*this);
+  }
+
+  // Calls fn(T&) on the values at positions [first, last), in order. Nodes
+  // this version shares with others are copied before their first write and
+  // the rest are written in place, so over a version nothing else holds this
+  // runs close to a loop over a vector. base::Interned and base::Packed
+  // cannot write into their nodes and apply an update per value instead.
+  template <typename Fn>
+  persistent_array modify_range(size_t first, size_t last, Fn fn) const& {
+    return persistent_array{*this}.modify_range(first, last, std::move(fn));
+  }
+
+  // Writes in place like update() &&, under the same threading rules.
+  template <typename Fn>
+  persistent_array modify_range(size_t first, size_t last, Fn fn) && {
+    if constexpr (requires { std::move(base).modify_range(first, last, fn); }) {
+      base = std::move(base).modify_range(first, last, fn);
+    } else {
+      std::vector<T> values(last - first);
+      base.copy_to(first, last, values.data());
+      for (size_t i = 0; i < values.size(); ++i) {
+        fn(values[i]);
+        base = std::move(base).update(first + i, std::move(values[i]));
+      }
+    }
+    return std::move(*this);
+  }
+
+  // Inserts before position index. Takes O(log n) time with base::Initial
+  // and base::MySharedPtr, which stay balanced under any sequence of edits;
+  // the other backends rebuild the array.
+  persistent_array insert(size_t index, T value) const {
+    auto first = std::make_move_iterator(&value);
+    return splice(index, index, Base::from_iter(first, first + 1));
+  }
+
+  template <base::SizedIterator Iter>
+  persistent_array insert(size_t index, Iter first, Iter last) const {
+    return splice(index, index, Base::from_iter(first, last));
+  }
+
+  persistent_array erase(size_t first, size_t last) const {
+    T* none = nullptr;
+    return splice(first, last, Base::from_iter(none, none));
+  }
+
+  typename iterator::reference operator[](size_t i) const {
+    return *(begin() + i);
+  }
+
+  // Random access that remembers where it last read. get() moves a cached
+  // iterator, which climbs only to the common ancestor of the old and new
+  // positions instead of starting at the root, so reads near each other
+  // take amortised O(1) time. Keeps the version it reads alive.
+  class reader {
+    persistent_array array;
+    iterator it;
+    size_t index = 0;
+
+   public:
+    explicit reader(persistent_array array)
+        : array(std::move(array)), it(this->array.begin()) {}
+
+    typename iterator::reference get(size_t i) {
+      it += static_cast<typename iterator::difference_type>(i - index);
+      index = i;
+      return *it;
+    }
+
+    const persistent_array& version() const { return array; }
+  };
+
+  reader read() const { return reader(*this); }
+
+  // Searches of a version sorted by comp. With base::Initial and
+  // base::MySharedPtr, and T small and trivially copyable, each one is a
+  // single descent in O(log n) time; other arrays take O(log^2 n).
+  template <typename K, typename Compare = std::less<>>
+  iterator lower_bound(const K& key, Compare comp = {}) const {
+    return begin() + rank(key, comp);
+  }
+
+  template <typename K, typename Compare = std::less<>>
+  iterator upper_bound(const K& key, Compare comp = {}) const {
+    return begin() +
+           partition_point([&](const T& x) { return !comp(key, x); });
+  }
+
+  template <typename K, typename Compare = std::less<>>
+  std::pair<iterator, iterator> equal_range(const K& key,
+                                            Compare comp = {}) const {
+    return {lower_bound(key, comp), upper_bound(key, comp)};
+  }
+
+  // The number of values less than key.
+  template <typename K, typename Compare = std::less<>>
+  size_t rank(const K& key, Compare comp = {}) const {
+    return partition_point([&](const T& x) { return comp(x, key); });
+  }
+
+  // The value of rank k in a sorted version, which is the one at position k.
+  typename iterator::reference select(size_t k) const { return (*this)[k]; }
+
+  // Looks up every index and writes the values to out, in order. Lookups run
+  // in groups that move down the tree one level per round, and each round
+  // prefetches what the next one reads, so the cache misses of a whole group
+  // overlap instead of following each other.
+  template <typename Out>
+  Out gather(std::span<const size_t> indices, Out out) const {
+    static constexpr size_t GROUP = 16;
+    std::array<typename Base::Probe, GROUP> probes;
+    for (size_t first = 0; first < indices.size(); first += GROUP) {
+      size_t count = std::min(GROUP, indices.size() - first);
+      for (size_t i = 0; i < count; ++i) {
+        probes[i] = base.probe(indices[first + i]);
+      }
+      for (bool active = true; active;) {
+        active = false;
+        for (size_t i = 0; i < count; ++i) {
+          active |= Base::step(probes[i]);
+        }
+      }
+      for (size_t i = 0; i < count; ++i) {
+        *out++ = Base::value(probes[i]);
+      }
+    }
+    return out;
+  }
+
+  // Coroutine form of operator[] for an async::scheduler to interleave with
+  // other lookups: each resume moves one level down and suspends once the
+  // next level is prefetched. The array must outlive the lookup.
+  async::lookup<typename iterator::reference> async_get(size_t index) const {
+    auto probe = base.probe(index);
+    do {
+      co_await std::suspend_always{};
+    } while (Base::step(probe));
+    co_return Base::value(probe);
+  }
+
+  // Copies positions [first, last) to out, which must have room for them, and
+  // returns the end of the output. Backends with multi-value leaves copy a
+  // leaf at a time, which for trivially copyable T is a memcpy. With threads
+  // > 1 the range is split into that many chunks copied concurrently; chunks
+  // below PARALLEL_CHUNK elements are not worth a thread.
+  T* copy_to(size_t first, size_t last, T* out, size_t threads = 1) const {
+    static constexpr size_t PARALLEL_CHUNK = 1 << 16;
+    size_t count = last - first;
+    threads = std::max<size_t>(1, std::min(threads, count / PARALLEL_CHUNK));
+    if (threads == 1) {
+      return base.copy_to(first, last, out);
+    }
+    std::vector<std::jthread> workers;
+    for (size_t i = 1; i < threads; ++i) {
+      size_t begin = first + count * i / threads;
+      size_t end = first + count * (i + 1) / threads;
+      workers.emplace_back([this, begin, end, out = out + (begin - first)] {
+        base.copy_to(begin, end, out);
+      });
+    }
+    base.copy_to(first, first + count / threads, out);
+    return out + count;
+  }
+
+  std::vector<T> to_vector(size_t threads = 1) const {
+    std::vector<T> result(size());
+    copy_to(0, result.size(), result.data(), threads);
+    return result;
+  }
+
+  // Compares values, skipping subtrees the two versions share.
+  bool operator==(const persistent_array& other) const {
+    return base == other.base;
+  }
+
+  // Only base::Interned caches a hash in its nodes, so only it has hash()
+  // and std::hash; other backends would need another word in every node.
+  size_t hash() const
+    requires requires(const Base& base) { base.hash(); }
+  {
+    return base.hash();
+  }
+};
+
+template <typename T, typename Base>
+  requires requires(const persistent_array<T, Base>& pa) { pa.hash(); }
+struct std::hash<persistent_array<T, Base>> {
+  size_t operator()(const persistent_array<T, Base>& pa) const {
+    return pa.hash();
+  }
 };
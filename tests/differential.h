@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <vector>
+#include "persistent_array.h"
+
+// One operation of a differential run. The arguments are raw numbers that
+// Differential::apply() reduces to a version, positions and values.
+struct Op {
+  enum Kind : uint8_t {
+    UPDATE,
+    MOVE_UPDATE,
+    INSERT,
+    ERASE,
+    JUMPS,
+    READER,
+    COPY,
+    COMPARE,
+    MODIFY,
+    KINDS
+  };
+
+  uint8_t kind;
+  uint32_t a, b, c;
+};
+
+// Keeps versions of a persistent array next to vectors holding what they
+// should contain, applies the same operations to both and reports the first
+// difference. Versions are derived from any earlier one, so they share nodes
+// in every combination; the oldest ones are dropped past max_versions.
+template <typename Base>
+class Differential {
+  using pa_t = persistent_array<int, Base>;
+
+  std::vector<pa_t> versions;
+  std::vector<std::vector<int>> models;
+  size_t max_versions;
+
+  void add(pa_t version, std::vector<int> model) {
+    versions.push_back(std::move(version));
+    models.push_back(std::move(model));
+    if (versions.size() > max_versions) {
+      versions.erase(versions.begin());
+      models.erase(models.begin());
+    }
+  }
+
+  // Moves an iterator around by offsets drawn from seed, checking its
+  // position and value after every step.
+  static bool check_jumps(const pa_t& pa, const std::vector<int>& model,
+                          size_t start, uint32_t seed) {
+    std::minstd_rand rnd(seed + 1);
+    auto it = pa.begin() + start;
+    ptrdiff_t index = start;
+    ptrdiff_t size = model.size();
+    for (int step = 0; step < 16; ++step) {
+      if (it - pa.begin() != index || pa.end() - it != size - index) {
+        return false;
+      }
+      if (index < size) {
+        if (*it != model[index] || it[-index] != model[0] ||
+            *(pa.end() - (size - index)) != model[index]) {
+          return false;
+        }
+      }
+      ptrdiff_t target = rnd() % (size + 1);
+      if (step % 2) {
+        // Short hops climb only a few levels.
+        target = std::clamp<ptrdiff_t>(
+            index + static_cast<ptrdiff_t>(rnd() % 9) - 4, 0, size);
+      }
+      if ((it < pa.begin() + target) != (index < target)) {
+        return false;
+      }
+      if (rnd() % 2) {
+        it += target - index;
+      } else {
+        it = it - (index - target);
+      }
+      index = target;
+    }
+    return true;
+  }
+
+ public:
+  explicit Differential(size_t n, size_t max_versions = 64)
+      : max_versions(max_versions) {
+    std::vector<int> initial(n);
+    std::iota(initial.begin(), initial.end(), 0);
+    add(pa_t(initial.begin(), initial.end()), initial);
+  }
+
+  // Returns false if a read disagrees with the model. Versions themselves are
+  // compared by check() and check_all().
+  bool apply(const Op& op) {
+    size_t v = op.a % versions.size();
+    const pa_t& pa = versions[v];
+    const std::vector<int>& model = models[v];
+    size_t size = model.size();
+    int value = static_cast<int>(op.c);
+    switch (op.kind % Op::KINDS) {
+      case Op::UPDATE:
+        if (size) {
+          auto next = model;
+          next[op.b % size] = value;
+          add(pa.update(op.b % size, value), std::move(next));
+        }
+        break;
+      case Op::MOVE_UPDATE:
+        // Changes version v itself; nodes it shares are copied first.
+        if (size) {
+          models[v][op.b % size] = value;
+          versions[v] = std::move(versions[v]).update(op.b % size, value);
+        }
+        break;
+      case Op::INSERT: {
+        size_t index = op.b % (size + 1);
+        auto next = model;
+        next.insert(next.begin() + index, value);
+        add(pa.insert(index, value), std::move(next));
+        break;
+      }
+      case Op::ERASE: {
+        size_t first = op.b % (size + 1);
+        size_t last = first + op.c % (std::min<size_t>(size - first, 16) + 1);
+        auto next = model;
+        next.erase(next.begin() + first, next.begin() + last);
+        add(pa.erase(first, last), std::move(next));
+        break;
+      }
+      case Op::JUMPS:
+        return check_jumps(pa, model, op.b % (size + 1), op.c);
+      case Op::READER:
+        if (size) {
+          auto reader = pa.read();
+          size_t index = op.b % size;
+          for (uint32_t step = 0; step < 16; ++step) {
+            index = (index + (op.c >> step) % 5 + size - 2) % size;
+            if (reader.get(index) != model[index]) {
+              return false;
+            }
+          }
+        }
+        break;
+      case Op::COPY: {
+        size_t first = op.b % (size + 1);
+        size_t last = first + op.c % (size - first + 1);
+        std::vector<int> out(last - first);
+        if (pa.copy_to(first, last, out.data()) != out.data() + out.size() ||
+            !std::equal(out.begin(), out.end(), model.begin() + first)) {
+          return false;
+        }
+        std::vector<size_t> indices(size ? 8 : 0);
+        for (size_t i = 0; i < indices.size(); ++i) {
+          indices[i] = (op.c + i * op.b) % size;
+        }
+        std::vector<int> gathered(indices.size());
+        pa.gather(indices, gathered.begin());
+        for (size_t i = 0; i < indices.size(); ++i) {
+          if (gathered[i] != model[indices[i]]) {
+            return false;
+          }
+        }
+        break;
+      }
+      case Op::MODIFY: {
+        // In place into version v half the time, like MOVE_UPDATE.
+        size_t first = op.b % (size + 1);
+        size_t last = first + op.c % (size - first + 1);
+        auto next = model;
+        auto shift = [delta = value % 256](int& x) { x += delta; };
+        std::for_each(next.begin() + first, next.begin() + last, shift);
+        if (op.c % 2) {
+          models[v] = std::move(next);
+          versions[v] =
+              std::move(versions[v]).modify_range(first, last, shift);
+        } else {
+          add(pa.modify_range(first, last, shift), std::move(next));
+        }
+        break;
+      }
+      case Op::COMPARE: {
+        size_t w = op.b % versions.size();
+        if ((versions[w] == pa) != (models[w] == model)) {
+          return false;
+        }
+        break;
+      }
+    }
+    return true;
+  }
+
+  // Compares version v with its model through iteration in both directions.
+  bool check(size_t v) const {
+    const pa_t& pa = versions[v];
+    const std::vector<int>& model = models[v];
+    return pa.size() == model.size() &&
+           std::equal(pa.begin(), pa.end(), model.begin(), model.end()) &&
+           std::equal(pa.rbegin(), pa.rend(), model.rbegin(), model.rend());
+  }
+
+  bool check_all() const {
+    for (size_t v = 0; v < versions.size(); ++v) {
+      if (!check(v)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const std::vector<pa_t>& all_versions() const { return versions; }
+
+  const std::vector<std::vector<int>>& all_models() const { return models; }
+};
@@ -0,0 +1,39 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include "differential.h"
+
+// libFuzzer entry point. The first two bytes of the input pick the initial
+// size; every following group of seven is an operation, run against each
+// backend and checked against a vector. Any difference aborts.
+template <typename Base>
+void run(const uint8_t* data, size_t size) {
+  if (size < 2) {
+    return;
+  }
+  Differential<Base> differential((data[0] | data[1] << 8) % 2048, 16);
+  for (size_t i = 2; i + 7 <= size; i += 7) {
+    const uint8_t* bytes = data + i;
+    Op op{bytes[0], static_cast<uint32_t>(bytes[1] | bytes[2] << 8),
+          static_cast<uint32_t>(bytes[3] | bytes[4] << 8),
+          static_cast<uint32_t>(bytes[5] | bytes[6] << 8)};
+    if (!differential.apply(op)) {
+      std::abort();
+    }
+  }
+  if (!differential.check_all()) {
+    std::abort();
+  }
+}
+
+template <typename... Bases>
+void run_all(const uint8_t* data, size_t size) {
+  (run<Bases>(data, size), ...);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  run_all<base::Initial<int>, base::MySharedPtr<int>, base::FourFold<int>,
+          base::EightFold<int>, base::Interned<int>, base::Packed<int>,
+          base::Wide<int>, base::Small<int>>(data, size);
+  return 0;
+}
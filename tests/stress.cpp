@@ -1,5 +1,8 @@
 #include <gtest/gtest.h>
+#include <map>
 #include <random>
+#include <thread>
+#include "differential.h"
 #include "persistent_array.h"
 #include "util.h"
 
@@ -43,4 +46,220 @@ TYPED_TEST(TestStress, Updates) {
       ASSERT_EQ(fast[i][0], slow[i][0]);
     }
   }
-}
\ No newline at end of file
+}
+
+// Updates random positions of random earlier versions with every backend and
+// checks every element of every version.
+TYPED_TEST(TestStress, RandomPositionUpdates) {
+  const int MAX_ITERS = 200'000;
+  std::mt19937 rnd{};
+
+  for (int n : {1, 2, 3, 4, 5, 50, 200, 1000}) {
+    const int iters = MAX_ITERS / n;
+
+    std::vector<int> initial(n, 0);
+    std::vector<persistent_array<int, TypeParam>> fast;
+    fast.emplace_back(initial.begin(), initial.end());
+    std::vector<SlowPersistentArray<int>> slow;
+    slow.emplace_back(initial);
+
+    for (int i = 0; i < iters; ++i) {
+      int index = rnd() % (i + 1);
+      int position = rnd() % n;
+      int new_val = rnd();
+      fast.push_back(fast[index].update(position, new_val));
+      slow.push_back(slow[index].update(position, new_val));
+    }
+
+    for (int i = 0; i < iters + 1; ++i) {
+      for (int j = 0; j < n; ++j) {
+        ASSERT_EQ(fast[i][j], slow[i][j]);
+      }
+    }
+  }
+}
+
+TYPED_TEST(TestStress, Differential) {
+  std::mt19937 rnd{};
+  for (size_t n : {0, 1, 2, 3, 17, 64, 1000}) {
+    Differential<TypeParam> differential(n);
+    for (int i = 0; i < 20'000; ++i) {
+      Op op{static_cast<uint8_t>(rnd()), static_cast<uint32_t>(rnd()),
+            static_cast<uint32_t>(rnd()), static_cast<uint32_t>(rnd())};
+      ASSERT_TRUE(differential.apply(op)) << "n = " << n << ", op " << i;
+      if (i % 1000 == 0) {
+        ASSERT_TRUE(differential.check_all()) << "n = " << n << ", op " << i;
+      }
+    }
+    ASSERT_TRUE(differential.check_all()) << "n = " << n;
+  }
+}
+
+TYPED_TEST(TestStress, LargeN) {
+  const size_t N = 1 << 20;
+  std::mt19937 rnd{};
+  Differential<TypeParam> differential(N, 8);
+  // Leaves out insert and erase, which rebuild the array with most backends.
+  for (uint8_t kind : {Op::UPDATE, Op::MOVE_UPDATE, Op::JUMPS, Op::READER,
+                       Op::COMPARE}) {
+    for (int i = 0; i < 500; ++i) {
+      Op op{kind, static_cast<uint32_t>(rnd()), static_cast<uint32_t>(rnd()),
+            static_cast<uint32_t>(rnd())};
+      ASSERT_TRUE(differential.apply(op)) << "op " << i;
+    }
+  }
+  ASSERT_TRUE(differential.check_all());
+}
+
+// Threads only read versions they share, which every backend allows: nothing
+// is copied, so no reference count changes.
+TYPED_TEST(TestStress, ConcurrentReads) {
+  std::mt19937 rnd{};
+  Differential<TypeParam> differential(5000);
+  for (int i = 0; i < 200; ++i) {
+    Op op{Op::UPDATE, static_cast<uint32_t>(rnd()),
+          static_cast<uint32_t>(rnd()), static_cast<uint32_t>(rnd())};
+    differential.apply(op);
+  }
+  auto& versions = differential.all_versions();
+  auto& models = differential.all_models();
+
+  std::vector<std::thread> threads;
+  std::vector<char> ok(4);
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t] {
+      std::mt19937 rnd(t);
+      ok[t] = true;
+      for (int i = 0; i < 2000; ++i) {
+        size_t v = rnd() % versions.size();
+        size_t first = rnd() % models[v].size();
+        auto it = versions[v].begin() + first;
+        for (size_t j = first; j < std::min(first + 64, models[v].size());
+             ++j, ++it) {
+          ok[t] = ok[t] && *it == models[v][j] &&
+                  versions[v][j] == models[v][j];
+        }
+      }
+      ok[t] = ok[t] && differential.check_all();
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (int t = 0; t < 4; ++t) {
+    ASSERT_TRUE(ok[t]);
+  }
+}
+
+// Backends whose reference counts are atomic, so threads can derive new
+// versions from shared ones.
+// clang-format off
+template <typename T>
+using ThreadSafeTypes = ::testing::Types<
+    base::Initial<T>,
+    base::Interned<T>
+    >;
+// clang-format on
+
+template <typename Base>
+struct TestSharedStress : ::testing::Test {};
+TYPED_TEST_SUITE(TestSharedStress, ThreadSafeTypes<int>);
+
+TYPED_TEST(TestSharedStress, ConcurrentUpdates) {
+  using pa_t = persistent_array<int, TypeParam>;
+  const int N = 100;
+  const int ITERS = 20'000;
+  const pa_t shared(N, 0);
+
+  std::vector<std::thread> threads;
+  std::vector<char> ok(4);
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t] {
+      std::mt19937 rnd(t);
+      std::vector<pa_t> fast = {shared};
+      std::vector<SlowPersistentArray<int>> slow = {{std::vector<int>(N)}};
+      for (int i = 0; i < ITERS; ++i) {
+        int index = rnd() % fast.size();
+        int position = rnd() % N;
+        int new_val = rnd() % 4;
+        fast.push_back(fast[index].update(position, new_val));
+        slow.push_back(slow[index].update(position, new_val));
+        if (fast.size() > 64) {
+          fast.erase(fast.begin());
+          slow.erase(slow.begin());
+        }
+      }
+      ok[t] = true;
+      for (size_t i = 0; i < fast.size(); ++i) {
+        for (int j = 0; j < N; ++j) {
+          ok[t] = ok[t] && fast[i][j] == slow[i][j];
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (int t = 0; t < 4; ++t) {
+    ASSERT_TRUE(ok[t]);
+  }
+}
+
+// clang-format off
+template <typename T>
+using HugeTypes = ::testing::Types<
+    base::Initial<T, uint64_t>,
+    base::MySharedPtr<T, uint64_t>,
+    base::FourFold<T, uint64_t>,
+    base::EightFold<T, uint64_t>,
+    base::Interned<T, uint64_t>,
+    base::Packed<T, uint64_t>,
+    base::Wide<T, uint64_t>
+    >;
+// clang-format on
+
+template <typename Base>
+struct TestHugeStress : ::testing::Test {};
+TYPED_TEST_SUITE(TestHugeStress, HugeTypes<int>);
+
+TYPED_TEST(TestHugeStress, BeyondFourBillion) {
+  const size_t N = 5'000'000'000;
+  const size_t BOUNDARY = size_t{1} << 32;
+  using pa_t = persistent_array<int, TypeParam>;
+
+  pa_t pa(N, 7);
+  ASSERT_EQ(pa.size(), N);
+  ASSERT_GE(pa.max_size(), N);
+  ASSERT_EQ(pa.end() - pa.begin(), N);
+
+  std::mt19937_64 rnd{};
+  std::vector<std::pair<size_t, int>> updates;
+  for (size_t position : {size_t{0}, BOUNDARY - 1, BOUNDARY, N - 1}) {
+    updates.emplace_back(position, static_cast<int>(position % 1000));
+  }
+  for (int i = 0; i < 100; ++i) {
+    updates.emplace_back(rnd() % N, i);
+  }
+
+  pa_t updated = pa;
+  for (auto [position, value] : updates) {
+    updated = updated.update(position, value);
+  }
+  std::map<size_t, int> expected(updates.begin(), updates.end());
+  for (auto [position, value] : updates) {
+    expected[position] = value;
+  }
+  for (auto [position, value] : expected) {
+    ASSERT_EQ(updated[position], value);
+    ASSERT_EQ(pa[position], 7);
+    ASSERT_EQ((updated.begin() + position) - updated.begin(), position);
+  }
+
+  auto it = updated.begin() + (BOUNDARY - 2);
+  for (size_t i = BOUNDARY - 2; i < BOUNDARY + 2; ++i, ++it) {
+    ASSERT_EQ(*it, expected.contains(i) ? expected[i] : 7);
+  }
+  ASSERT_EQ(it - updated.begin(), BOUNDARY + 2);
+  ASSERT_EQ(updated.end() - it, N - BOUNDARY - 2);
+  ASSERT_EQ(*(updated.end() - 1), expected[N - 1]);
+}
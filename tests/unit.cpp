@@ -1,4 +1,10 @@
 #include <gtest/gtest.h>
+#include <cmath>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include "history.h"
 #include "persistent_array.h"
 #include "util.h"
 
@@ -54,6 +60,185 @@ TYPED_TEST(TestUpdate, Unchanged) {
   }
 }
 
+PA_TEST_SUITE(TestMoveUpdate, int);
+
+TYPED_TEST(TestMoveUpdate, Linear) {
+  using pa_t = persistent_array<int, TypeParam>;
+  const int N = 2000;
+  std::mt19937 rnd{};
+  std::vector<int> v(N, 0);
+  pa_t pa(N, 0);
+  for (int i = 0; i < 5000; ++i) {
+    int position = rnd() % N;
+    int new_val = rnd();
+    pa = std::move(pa).update(position, new_val);
+    v[position] = new_val;
+  }
+  ASSERT_TRUE(std::equal(v.begin(), v.end(), pa.begin(), pa.end()));
+}
+
+TYPED_TEST(TestMoveUpdate, SharedNodesAreCopied) {
+  using pa_t = persistent_array<int, TypeParam>;
+  pa_t pa(1000, 0);
+  pa = std::move(pa).update(3, 1);
+  ASSERT_EQ(std::count(pa.begin(), pa.end(), 0), 999);
+
+  pa_t old = pa;
+  auto next = std::move(pa).update(3, 2).update(997, 2);
+  ASSERT_EQ(old[3], 1);
+  ASSERT_EQ(old[997], 0);
+  ASSERT_EQ(next[3], 2);
+  ASSERT_EQ(next[997], 2);
+}
+
+TYPED_TEST(TestMoveUpdate, UpdateMany) {
+  using pa_t = persistent_array<int, TypeParam>;
+  const pa_t pa = {3, 1, 4, 1, 5, 9, 2, 6};
+  std::vector<std::pair<size_t, int>> changes = {{0, 7}, {7, 8}, {0, 9}};
+  auto updated = pa.update_many(changes);
+  ASSERT_EQ(updated, pa_t({9, 1, 4, 1, 5, 9, 2, 8}));
+  ASSERT_EQ(pa, pa_t({3, 1, 4, 1, 5, 9, 2, 6}));
+  ASSERT_EQ(pa_t(pa).update_many(changes), updated);
+}
+
+PA_TEST_SUITE(TestModifyRange, int);
+
+TYPED_TEST(TestModifyRange, MatchesVector) {
+  using pa_t = persistent_array<int, TypeParam>;
+  const int N = 1000;
+  std::mt19937 rnd{};
+  std::vector<int> v(N, 0);
+  pa_t pa(N, 0);
+  for (int i = 0; i < 200; ++i) {
+    size_t first = rnd() % (N + 1);
+    size_t last = first + rnd() % (N - first + 1);
+    int delta = rnd() % 100;
+    auto add = [&](int& x) { x += delta; };
+    pa_t old = pa;
+    std::vector<int> old_v = v;
+    if (i % 2) {
+      pa = std::move(pa).modify_range(first, last, add);
+    } else {
+      pa = pa.modify_range(first, last, add);
+    }
+    std::for_each(v.begin() + first, v.begin() + last, add);
+    ASSERT_TRUE(std::equal(v.begin(), v.end(), pa.begin(), pa.end()));
+    ASSERT_TRUE(std::equal(old_v.begin(), old_v.end(), old.begin(), old.end()));
+  }
+}
+
+TYPED_TEST(TestModifyRange, VisitsInOrder) {
+  using pa_t = persistent_array<int, TypeParam>;
+  pa_t pa(100, 0);
+  int next = 0;
+  pa = pa.modify_range(10, 90, [&](int& x) { x = next++; });
+  ASSERT_EQ(next, 80);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(pa[i], i < 10 || i >= 90 ? 0 : i - 10);
+  }
+}
+
+PA_TEST_SUITE(TestAdopt, int);
+
+TYPED_TEST(TestAdopt, FromBuffers) {
+  using pa_t = persistent_array<int, TypeParam>;
+  const int N = 1000;
+  std::vector<int> v(N);
+  std::iota(v.begin(), v.end(), 0);
+  auto copy = v;
+
+  pa_t from_vector(std::move(v));
+  ASSERT_TRUE(std::equal(copy.begin(), copy.end(), from_vector.begin(),
+                         from_vector.end()));
+  auto updated = from_vector.update(N / 2, -1);
+  ASSERT_EQ(from_vector[N / 2], N / 2);
+  ASSERT_EQ(updated[N / 2], -1);
+
+  auto buffer = std::make_unique<int[]>(N);
+  std::copy(copy.begin(), copy.end(), buffer.get());
+  pa_t from_unique(std::move(buffer), N);
+  ASSERT_EQ(from_unique, from_vector);
+}
+
+PA_TEST_SUITE(TestInsertErase, int);
+
+TYPED_TEST(TestInsertErase, MatchesVector) {
+  using pa_t = persistent_array<int, TypeParam>;
+  std::mt19937 rnd{};
+  pa_t pa;
+  ASSERT_EQ(pa.size(), 0);
+  ASSERT_EQ(pa.begin(), pa.end());
+  std::vector<int> expected;
+  std::vector<std::pair<pa_t, std::vector<int>>> versions;
+  for (int i = 0; i < 300; ++i) {
+    size_t index = rnd() % (expected.size() + 1);
+    switch (rnd() % 4) {
+      case 0:
+      case 1:
+        pa = pa.insert(index, i);
+        expected.insert(expected.begin() + index, i);
+        break;
+      case 2: {
+        std::vector<int> values(rnd() % 20, -i);
+        pa = pa.insert(index, values.begin(), values.end());
+        expected.insert(expected.begin() + index, values.begin(),
+                        values.end());
+        break;
+      }
+      case 3: {
+        size_t last = index + rnd() % (expected.size() - index + 1);
+        pa = pa.erase(index, last);
+        expected.erase(expected.begin() + index, expected.begin() + last);
+        break;
+      }
+    }
+    ASSERT_EQ(pa.size(), expected.size());
+    ASSERT_TRUE(std::equal(pa.begin(), pa.end(), expected.begin(),
+                           expected.end()));
+    if (i % 30 == 0) {
+      versions.emplace_back(pa, expected);
+    }
+  }
+  for (auto& [version, values] : versions) {
+    ASSERT_TRUE(std::equal(version.begin(), version.end(), values.begin(),
+                           values.end()));
+  }
+  pa = pa.erase(0, pa.size());
+  ASSERT_EQ(pa, pa_t());
+}
+
+template <typename Base>
+void check_balanced() {
+  using base::stats::Counting;
+  using pa_t = persistent_array<int, Base>;
+  const int N = 3000;
+  pa_t front, back, middle;
+  for (int i = 0; i < N; ++i) {
+    front = front.insert(0, i);
+    back = back.insert(i, i);
+    middle = middle.insert(i / 2, i);
+  }
+  middle = middle.erase(N / 4, N / 2);
+  // Each level of a balanced tree keeps at most 71% of the leaves.
+  for (auto& pa : {front, back, middle}) {
+    size_t bound = std::log(pa.size()) / std::log(1 / 0.71);
+    int value;
+    for (size_t i = 0; i < pa.size(); ++i) {
+      auto before = Counting::snapshot();
+      pa.gather(std::span(&i, 1), &value);
+      ASSERT_LE((Counting::snapshot() - before).descent_steps, bound);
+    }
+  }
+  ASSERT_EQ(front[0], N - 1);
+  ASSERT_EQ(back[0], 0);
+}
+
+TEST(TestInsertErase, StaysBalanced) {
+  using base::stats::Counting;
+  check_balanced<base::Initial<int, uint32_t, Counting>>();
+  check_balanced<base::MySharedPtr<int, uint32_t, Counting>>();
+}
+
 PA_TEST_SUITE(TestIterators, int);
 
 TYPED_TEST(TestIterators, TestAddition) {
@@ -90,6 +275,59 @@ TYPED_TEST(TestIterators, TestDifference) {
   }
 }
 
+TYPED_TEST(TestIterators, TestFilled) {
+  const int N = 100;
+
+  persistent_array<int, TypeParam> pa(N, 5);
+
+  for (int i = 0; i < N; ++i) {
+    ASSERT_EQ(pa[i], 5);
+    for (int j = 0; j < N; ++j) {
+      ASSERT_EQ(pa.begin() + i == pa.begin() + j, i == j);
+      ASSERT_EQ((pa.begin() + i) - (pa.begin() + j), i - j);
+    }
+  }
+
+  auto updated = pa.update(N / 2, 6);
+  ASSERT_EQ(std::count(updated.begin(), updated.end(), 5), N - 1);
+  ASSERT_EQ(updated[N / 2], 6);
+  ASSERT_EQ(pa[N / 2], 5);
+}
+
+TYPED_TEST(TestIterators, RandomJumps) {
+  const int N = 100'000;
+  std::vector<int> values(N);
+  std::iota(values.begin(), values.end(), 0);
+  persistent_array<int, TypeParam> pa(values.begin(), values.end());
+
+  std::mt19937 rnd{};
+  auto it = pa.begin();
+  int index = 0;
+  for (int i = 0; i < 10'000; ++i) {
+    int target = rnd() % (N + 1);
+    if (i % 4) {
+      // Mostly short hops, which stay within the cached part of the path.
+      target = std::clamp(index + static_cast<int>(rnd() % 65) - 32, 0, N);
+    }
+    it += target - index;
+    index = target;
+    ASSERT_EQ(it - pa.begin(), index);
+    if (index < N) {
+      ASSERT_EQ(*it, index);
+      ASSERT_EQ(it[-index], 0);
+    }
+  }
+}
+
+TEST(TestIterators, Compact) {
+  static_assert(sizeof(persistent_array<int, base::Initial<int>>::iterator) <=
+                128);
+  static_assert(
+      sizeof(persistent_array<int, base::MySharedPtr<int>>::iterator) <= 128);
+  static_assert(sizeof(persistent_array<int, base::Interned<int>>::iterator) <=
+                128);
+}
+
 PA_TEST_SUITE(TestRequirements, int);
 
 TYPED_TEST(TestRequirements, RandomAccessIterator) {
@@ -99,4 +337,727 @@ TYPED_TEST(TestRequirements, RandomAccessIterator) {
   static_assert(std::random_access_iterator<typename pa_t::reverse_iterator>);
   static_assert(
       std::random_access_iterator<typename pa_t::const_reverse_iterator>);
-}
\ No newline at end of file
+}
+
+PA_TEST_SUITE(TestReader, int);
+
+TYPED_TEST(TestReader, MatchesIndexing) {
+  using pa_t = persistent_array<int, TypeParam>;
+  const int N = 20'000;
+  std::mt19937 rnd{};
+  pa_t pa(N, 0);
+  for (int i = 0; i < N; ++i) {
+    pa = pa.update(rnd() % N, static_cast<int>(rnd()));
+  }
+  auto expected = pa.to_vector();
+  auto reader = pa.read();
+  pa = pa_t(N, 1);
+  size_t index = 0;
+  for (int i = 0; i < 10'000; ++i) {
+    if (i % 100) {
+      index = std::min<size_t>(N - 1, index + rnd() % 16);
+      index -= std::min<size_t>(index, rnd() % 8);
+    } else {
+      index = rnd() % N;
+    }
+    ASSERT_EQ(reader.get(index), expected[index]);
+  }
+  ASSERT_EQ(reader.version().size(), N);
+}
+
+PA_TEST_SUITE(TestSearch, int);
+
+TYPED_TEST(TestSearch, MatchesStd) {
+  using pa_t = persistent_array<int, TypeParam>;
+  std::mt19937 rnd{};
+  std::vector<int> values(3000);
+  for (auto& value : values) {
+    value = rnd() % 1000;
+  }
+  std::sort(values.begin(), values.end());
+  pa_t pa(values.begin(), values.end());
+  // Keeps the version sorted while changing its last value.
+  values.back() = 2000;
+  pa = std::move(pa).update(values.size() - 1, 2000);
+  for (int key = -1; key <= 2001; ++key) {
+    auto lower = std::lower_bound(values.begin(), values.end(), key);
+    auto upper = std::upper_bound(values.begin(), values.end(), key);
+    ASSERT_EQ(pa.lower_bound(key) - pa.begin(), lower - values.begin());
+    ASSERT_EQ(pa.upper_bound(key) - pa.begin(), upper - values.begin());
+    auto [first, last] = pa.equal_range(key);
+    ASSERT_EQ(last - first, upper - lower);
+    ASSERT_EQ(pa.rank(key), lower - values.begin());
+  }
+  for (size_t k = 0; k < values.size(); k += 7) {
+    ASSERT_EQ(pa.select(k), values[k]);
+  }
+
+  std::reverse(values.begin(), values.end());
+  pa_t reversed(values.begin(), values.end());
+  for (int key : {-1, 0, 500, 999, 2000, 2001}) {
+    auto lower = std::lower_bound(values.begin(), values.end(), key,
+                                  std::greater<>());
+    ASSERT_EQ(reversed.rank(key, std::greater<>()), lower - values.begin());
+  }
+  ASSERT_EQ(pa_t().rank(0), 0);
+}
+
+TEST(TestSearch, DescendsOnce) {
+  using base::stats::Counting;
+  using pa_t =
+      persistent_array<int, base::MySharedPtr<int, uint32_t, Counting>>;
+  std::vector<int> values(10'000);
+  std::iota(values.begin(), values.end(), 0);
+  pa_t pa(values.begin(), values.end());
+  for (int i = 0; i < 100; ++i) {
+    pa = pa.insert(0, -1 - i);
+  }
+  auto before = Counting::snapshot();
+  ASSERT_EQ(pa.rank(5000), 5100);
+  auto search = Counting::snapshot() - before;
+  ASSERT_EQ(search.descents, 1);
+  ASSERT_LE(search.descent_steps, 20);
+
+  std::vector<std::string> strings = {"a", "b", "c"};
+  persistent_array<std::string> fallback(strings.begin(), strings.end());
+  ASSERT_EQ(fallback.rank("bb"), 2);
+}
+
+PA_TEST_SUITE(TestGather, int);
+
+TYPED_TEST(TestGather, MatchesIndexing) {
+  using pa_t = persistent_array<int, TypeParam>;
+  const int N = 5000;
+  std::mt19937 rnd{};
+  pa_t pa(N, 0);
+  for (int i = 0; i < N; ++i) {
+    pa = pa.update(rnd() % N, static_cast<int>(rnd()));
+  }
+  for (size_t count : {0, 1, 15, 16, 17, 1000}) {
+    std::vector<size_t> indices(count);
+    for (auto& index : indices) {
+      index = rnd() % N;
+    }
+    std::vector<int> out(count + 1, -1);
+    auto last = pa.gather(indices, out.begin());
+    ASSERT_EQ(last - out.begin(), count);
+    for (size_t i = 0; i < count; ++i) {
+      ASSERT_EQ(out[i], pa[indices[i]]);
+    }
+    ASSERT_EQ(out[count], -1);
+  }
+}
+
+PA_TEST_SUITE(TestCopyTo, int);
+
+TYPED_TEST(TestCopyTo, MatchesIteration) {
+  using pa_t = persistent_array<int, TypeParam>;
+  const int N = 5000;
+  std::mt19937 rnd{};
+  pa_t pa(N, 7);
+  for (int i = 0; i < N; ++i) {
+    pa = pa.update(rnd() % N, static_cast<int>(rnd()));
+  }
+  std::vector<int> expected(pa.begin(), pa.end());
+  ASSERT_EQ(pa.to_vector(), expected);
+  for (auto [first, last] : {std::pair{0, 0}, {0, 1}, {63, 64}, {27, 1000},
+                             {100, N}, {N - 1, N}}) {
+    std::vector<int> out(last - first + 1, -1);
+    int* end = pa.copy_to(first, last, out.data());
+    ASSERT_EQ(end - out.data(), last - first);
+    ASSERT_TRUE(std::equal(out.begin(), out.end() - 1,
+                           expected.begin() + first));
+    ASSERT_EQ(out.back(), -1);
+  }
+}
+
+TYPED_TEST(TestCopyTo, Parallel) {
+  using pa_t = persistent_array<int, TypeParam>;
+  const int N = 300'000;
+  std::vector<int> values(N);
+  std::iota(values.begin(), values.end(), 0);
+  pa_t pa(values.begin(), values.end());
+  ASSERT_EQ(pa.to_vector(4), values);
+  std::vector<int> out(N - 2);
+  pa.copy_to(1, N - 1, out.data(), 3);
+  ASSERT_TRUE(std::equal(out.begin(), out.end(), values.begin() + 1));
+}
+
+PA_TEST_SUITE(TestAsync, int);
+
+TYPED_TEST(TestAsync, MatchesIndexing) {
+  using pa_t = persistent_array<int, TypeParam>;
+  const int N = 3000;
+  std::mt19937 rnd{};
+  std::vector<pa_t> versions = {pa_t(N, 0)};
+  for (int i = 0; i < 100; ++i) {
+    versions.push_back(
+        versions.back().update(rnd() % N, static_cast<int>(rnd())));
+  }
+  for (size_t width : {1, 7, 32}) {
+    std::vector<std::pair<size_t, size_t>> queries;
+    std::vector<async::lookup<typename pa_t::iterator::reference>> lookups;
+    async::scheduler scheduler(width);
+    for (int i = 0; i < 500; ++i) {
+      queries.emplace_back(rnd() % versions.size(), rnd() % N);
+      lookups.push_back(
+          versions[queries.back().first].async_get(queries.back().second));
+    }
+    for (auto& lookup : lookups) {
+      scheduler.add(lookup);
+    }
+    scheduler.run();
+    for (size_t i = 0; i < queries.size(); ++i) {
+      auto [version, index] = queries[i];
+      ASSERT_TRUE(lookups[i].done());
+      ASSERT_EQ(lookups[i].get(), versions[version][index]);
+    }
+  }
+}
+
+TEST(TestAsync, RepeatedAndFinishedLookups) {
+  persistent_array<int> pa = {3, 1, 4, 1, 5};
+  auto lookup = pa.async_get(2);
+  auto other = pa.async_get(4);
+  async::scheduler scheduler(2);
+  scheduler.add(lookup);
+  scheduler.add(lookup);
+  scheduler.add(other);
+  scheduler.run();
+  ASSERT_EQ(lookup.get(), 4);
+  ASSERT_EQ(other.get(), 5);
+  scheduler.add(lookup);
+  scheduler.run();
+  ASSERT_EQ(lookup.get(), 4);
+
+  auto moved = std::move(other);
+  ASSERT_TRUE(other.done());
+  ASSERT_EQ(moved.get(), 5);
+  ASSERT_THROW(async::scheduler(0), std::invalid_argument);
+}
+
+TEST(TestInterned, EqualVersionsShareNodes) {
+  using pa_t = persistent_array<int, base::Interned<int>>;
+  pa_t a = {1, 2, 3, 2, 1};
+  pa_t b = {1, 2, 3, 2, 1};
+  for (int i = 0; i < 5; ++i) {
+    ASSERT_EQ(&a[i], &b[i]);
+  }
+  ASSERT_EQ(&a[0], &a[4]);
+  ASSERT_EQ(&a[1], &a[3]);
+
+  auto c = a.update(2, 7).update(2, 3);
+  for (int i = 0; i < 5; ++i) {
+    ASSERT_EQ(&a[i], &c[i]);
+  }
+}
+
+TEST(TestInterned, DroppedNodesAreForgotten) {
+  using pa_t = persistent_array<int, base::Interned<int>>;
+  int value = 0;
+  {
+    pa_t a = {12345, 54321};
+    value = a[0];
+  }
+  pa_t b = {12345, 54321};
+  ASSERT_EQ(b[0], value);
+  ASSERT_EQ(b.update(1, 12345)[1], 12345);
+}
+
+PA_TEST_SUITE(TestEquality, int);
+
+TYPED_TEST(TestEquality, Equal) {
+  using pa_t = persistent_array<int, TypeParam>;
+  pa_t a = {3, 1, 4, 1, 5, 9, 2};
+  pa_t b = {3, 1, 4, 1, 5, 9, 2};
+  ASSERT_EQ(a, a);
+  ASSERT_EQ(a, b);
+  ASSERT_EQ(a.update(3, 7), b.update(3, 7));
+  ASSERT_EQ(a.update(3, 7).update(3, 1), b);
+}
+
+TYPED_TEST(TestEquality, NotEqual) {
+  using pa_t = persistent_array<int, TypeParam>;
+  pa_t a = {3, 1, 4, 1, 5, 9, 2};
+  ASSERT_NE(a, a.update(6, 6));
+  ASSERT_NE(a, a.update(0, 0));
+  ASSERT_NE(a, pa_t({3, 1, 4, 1, 5, 9}));
+  ASSERT_NE(a, pa_t(7));
+}
+
+TEST(TestInterned, Hash) {
+  using pa_t = persistent_array<int, base::Interned<int>>;
+  pa_t a = {3, 1, 4, 1, 5, 9, 2};
+  pa_t b(7, 0);
+  for (int i = 0; i < 7; ++i) {
+    b = b.update(i, a[i]);
+  }
+  ASSERT_EQ(std::hash<pa_t>{}(a), std::hash<pa_t>{}(b));
+  ASSERT_NE(a.hash(), a.update(2, 2).hash());
+}
+
+template <typename T>
+void check_packed(const std::vector<T>& v) {
+  persistent_array<T, base::Packed<T>> pa(v.begin(), v.end());
+  ASSERT_EQ(pa.size(), v.size());
+  ASSERT_TRUE(std::equal(v.begin(), v.end(), pa.begin(), pa.end()));
+  for (size_t i = 0; i < v.size(); ++i) {
+    ASSERT_EQ(pa[i], v[i]);
+  }
+}
+
+TEST(TestPacked, Extremes) {
+  using limits = std::numeric_limits<int64_t>;
+  check_packed<int64_t>({limits::min(), limits::max(), 0, -1, 1});
+  check_packed<int64_t>(std::vector<int64_t>(1000, limits::min()));
+  check_packed<uint64_t>({0, UINT64_MAX, 1ull << 63, 5});
+  check_packed<int8_t>({-128, 127, 0, -1});
+  check_packed<uint16_t>({65535, 0, 1, 2});
+}
+
+TEST(TestPacked, Blocks) {
+  std::mt19937 rnd{};
+  for (size_t n : {63, 64, 65, 511, 512, 513, 4097, 70000}) {
+    std::vector<int64_t> v(n);
+    for (auto& x : v) {
+      x = 1'000'000 + rnd() % 1000;
+    }
+    check_packed(v);
+  }
+}
+
+TEST(TestPacked, Updates) {
+  const int N = 5000;
+  std::mt19937 rnd{};
+  std::vector<int64_t> v(N, 7);
+  persistent_array<int64_t, base::Packed<int64_t>> pa(N, 7);
+  for (int i = 0; i < 10'000; ++i) {
+    int position = rnd() % N;
+    int64_t new_val = static_cast<int64_t>(rnd()) << (rnd() % 32);
+    pa = pa.update(position, new_val);
+    v[position] = new_val;
+    ASSERT_EQ(pa[position], new_val);
+  }
+  ASSERT_TRUE(std::equal(v.begin(), v.end(), pa.begin(), pa.end()));
+  for (int i = 0; i < N; i += 97) {
+    ASSERT_EQ(*(pa.end() - (N - i)), v[i]);
+    ASSERT_EQ(pa.end() - (pa.begin() + i), N - i);
+  }
+}
+
+TEST(TestWide, NodeLayout) {
+  using wide = base::Wide<int>;
+  static_assert(sizeof(wide::IntermediateNode) == 128);
+  static_assert(wide::LEAF_BYTES == 128);
+  static_assert(wide::K == 15 && wide::LEAF_SIZE == 28);
+  static_assert(base::Wide<std::array<char, 300>>::LEAF_SIZE == 1);
+}
+
+TEST(TestWide, NonTrivialValues) {
+  using pa_t = persistent_array<std::string, base::Wide<std::string>>;
+  std::vector<std::string> v;
+  for (int i = 0; i < 1000; ++i) {
+    v.push_back(std::string(i % 50, 'a' + i % 26));
+  }
+  pa_t pa(v.begin(), v.end());
+  for (int i = 0; i < 1000; i += 7) {
+    pa = pa.update(i, std::to_string(i));
+    v[i] = std::to_string(i);
+  }
+  ASSERT_TRUE(std::equal(v.begin(), v.end(), pa.begin(), pa.end()));
+  ASSERT_EQ(pa.begin()[999], v[999]);
+  ASSERT_EQ((pa.end() - 1)->size(), v.back().size());
+}
+
+TEST(TestWide, AdoptsBufferInPlace) {
+  using pa_t = persistent_array<int, base::Wide<int>>;
+  std::vector<int> v(1000);
+  std::iota(v.begin(), v.end(), 0);
+  const int* data = v.data();
+  pa_t pa(std::move(v));
+  ASSERT_EQ(&pa[0], data);
+  ASSERT_EQ(&pa[999], data + 999);
+
+  auto next = pa.update(5, -1);
+  ASSERT_EQ(pa[5], 5);
+  ASSERT_EQ(&next[500], data + 500);
+
+  pa = pa_t(1);
+  next = std::move(next).update(500, -2);
+  ASSERT_EQ(&next[500], data + 500);
+  ASSERT_EQ(next[500], -2);
+}
+
+TEST(TestWide, AdoptedBufferLifetime) {
+  using element = std::shared_ptr<int>;
+  auto sentinel = std::make_shared<int>(1);
+  std::optional<persistent_array<element, base::Wide<element>>> pa(
+      std::vector<element>(100, sentinel));
+  ASSERT_EQ(sentinel.use_count(), 101);
+
+  auto next = pa->update(3, nullptr);
+  pa.reset();
+  ASSERT_EQ(next[3], nullptr);
+  ASSERT_EQ(next[99], sentinel);
+  ASSERT_GT(sentinel.use_count(), 100);
+
+  next = persistent_array<element, base::Wide<element>>(1);
+  ASSERT_EQ(sentinel.use_count(), 1);
+}
+
+TEST(TestAuto, Selection) {
+  using base::Workload;
+  static_assert(std::same_as<base::Auto<int64_t>, base::Packed<int64_t>>);
+  static_assert(std::same_as<base::Auto<int, Workload::UPDATE_HEAVY>,
+                             base::FourFold<int>>);
+  static_assert(std::same_as<base::Auto<bool>, base::Wide<bool>>);
+  static_assert(std::same_as<base::Auto<std::string>,
+                             base::EightFold<std::string>>);
+  static_assert(std::same_as<base::Auto<std::string, Workload::READ_HEAVY>,
+                             base::EightFold<std::string>>);
+  static_assert(std::same_as<base::Auto<double, Workload::SCAN_HEAVY>,
+                             base::Wide<double>>);
+  static_assert(std::same_as<base::Auto<int, Workload::READ_HEAVY>,
+                             base::Packed<int>>);
+
+  persistent_array<std::string, base::Auto<std::string>> pa = {"a", "b"};
+  ASSERT_EQ(pa.update(1, "c")[1], "c");
+}
+
+template <typename Base>
+void check_stats() {
+  using base::stats::Counting;
+  const int N = 1000;
+  auto before = Counting::snapshot();
+  {
+    std::vector<int> v(N);
+    std::iota(v.begin(), v.end(), 0);
+    persistent_array<int, Base> pa(v.begin(), v.end());
+    auto built = Counting::snapshot() - before;
+    ASSERT_GT(built.nodes_allocated, N / 64);
+    ASSERT_EQ(built.live_nodes(), built.nodes_allocated);
+
+    // Path copying allocates one node per level plus the new leaf.
+    auto start = Counting::snapshot();
+    auto updated = pa.update(N / 2, -1);
+    auto update = Counting::snapshot() - start;
+    ASSERT_EQ(update.descents, 1);
+    ASSERT_GT(update.descent_steps, 0);
+    ASSERT_EQ(update.nodes_allocated, update.descent_steps + 1);
+
+    start = Counting::snapshot();
+    ASSERT_TRUE(std::equal(v.begin(), v.end(), pa.begin(), pa.end()));
+    auto scan = Counting::snapshot() - start;
+    ASSERT_EQ(scan.jumps, N);
+    ASSERT_GT(scan.mean_pop_distance(), 0);
+    ASSERT_LE(scan.mean_pop_distance(), 2);
+  }
+  ASSERT_EQ((Counting::snapshot() - before).live_nodes(), 0);
+}
+
+TEST(TestStats, Backends) {
+  using base::stats::Counting;
+  check_stats<base::Initial<int, uint32_t, Counting>>();
+  check_stats<base::MySharedPtr<int, uint32_t, Counting>>();
+  check_stats<base::FourFold<int, uint32_t, Counting>>();
+  check_stats<base::EightFold<int, uint32_t, Counting>>();
+  check_stats<base::Interned<int, uint32_t, Counting>>();
+  check_stats<base::Packed<int, uint32_t, Counting>>();
+  check_stats<base::Wide<int, uint32_t, Counting>>();
+}
+
+TEST(TestStats, ExitedThreads) {
+  using base::stats::Counting;
+  persistent_array<int, base::MySharedPtr<int, uint32_t, Counting>> pa(100);
+  auto before = Counting::snapshot();
+  std::thread([&] { pa.update(7, 7); }).join();
+  auto counted = Counting::snapshot() - before;
+  ASSERT_EQ(counted.descents, 1);
+  ASSERT_GT(counted.nodes_allocated, 0);
+  ASSERT_EQ(counted.live_nodes(), 0);
+}
+
+TEST(TestStats, MoveUpdateAllocatesNothing) {
+  using base::stats::Counting;
+  std::vector<int> v(1000);
+  persistent_array<int, base::EightFold<int, uint32_t, Counting>> pa(
+      v.begin(), v.end());
+  auto before = Counting::snapshot();
+  for (int i = 0; i < 1000; ++i) {
+    pa = std::move(pa).update(i, i);
+  }
+  ASSERT_EQ((Counting::snapshot() - before).nodes_allocated, 0);
+  ASSERT_EQ(pa[500], 500);
+}
+
+TEST(TestStats, ModifyRangeCopiesOnce) {
+  using base::stats::Counting;
+  std::vector<int> v(1000);
+  persistent_array<int, base::EightFold<int, uint32_t, Counting>> pa(
+      v.begin(), v.end());
+  auto shared = pa;
+  auto increment = [](int& x) { ++x; };
+  auto before = Counting::snapshot();
+  pa = std::move(pa).modify_range(0, 1000, increment);
+  ASSERT_GT((Counting::snapshot() - before).nodes_allocated, 0);
+  before = Counting::snapshot();
+  pa = std::move(pa).modify_range(0, 1000, increment);
+  ASSERT_EQ((Counting::snapshot() - before).nodes_allocated, 0);
+  ASSERT_EQ(pa[500], 2);
+  ASSERT_EQ(shared[500], 0);
+}
+
+TEST(TestStats, DisabledIsFree) {
+  static_assert(sizeof(base::MySharedPtr<int>::BaseNode) == 8);
+  static_assert(sizeof(base::Initial<int>::BaseNode) == 4);
+}
+
+template <typename Base>
+void check_recycled() {
+  const int N = 1000;
+  std::vector<int> v(N);
+  std::iota(v.begin(), v.end(), 0);
+  persistent_array<int, Base> pa(v.begin(), v.end());
+  std::mt19937 rnd{};
+  // Paths differ in length; after one update to each leaf the caches hold a
+  // block for every level of the deepest one.
+  for (int i = 0; i < N; ++i) {
+    pa = pa.update(i, i);
+  }
+  size_t before = base::fresh_blocks;
+  for (int i = 0; i < 1000; ++i) {
+    pa = pa.update(rnd() % N, i);
+  }
+  ASSERT_EQ(base::fresh_blocks, before);
+}
+
+// Interned also inserts into its table, and Packed leaves vary in size.
+TEST(TestRecycling, SteadyUpdatesDoNotAllocate) {
+  check_recycled<base::Initial<int>>();
+  check_recycled<base::MySharedPtr<int>>();
+  check_recycled<base::FourFold<int>>();
+  check_recycled<base::EightFold<int>>();
+  check_recycled<base::Wide<int>>();
+}
+
+// A version kept after the caches are warm takes its whole path from them.
+TEST(TestRecycling, CachedBytesFollowTheCaches) {
+  using base::stats::Counting;
+  using Base = base::EightFold<int, uint32_t, Counting>;
+  const int N = 1000;
+  std::vector<int> v(N);
+  persistent_array<int, Base> pa(v.begin(), v.end());
+  for (int i = 0; i < N; ++i) {
+    pa = pa.update(i, i);
+  }
+  size_t cached = base::cached_bytes;
+  auto before = Counting::snapshot();
+  auto kept = pa.update(N / 2, -1);
+  size_t nodes = (Counting::snapshot() - before).nodes_allocated;
+  ASSERT_EQ(cached - base::cached_bytes,
+            sizeof(Base::DataNode) +
+                (nodes - 1) * sizeof(Base::IntermediateNode));
+  kept = pa;
+  ASSERT_EQ(base::cached_bytes, cached);
+}
+
+TEST(TestRecycling, NodesFreedOnOtherThreads) {
+  using pa_t = persistent_array<int, base::Interned<int>>;
+  std::vector<pa_t> versions;
+  pa_t pa(1000, 0);
+  for (int i = 0; i < 100; ++i) {
+    versions.push_back(pa.update(i, i));
+  }
+  std::thread([&] { versions.clear(); }).join();
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(pa.update(i, -i)[i], -i);
+  }
+}
+
+// Crosses the capacity both ways, through a tree that splices natively.
+TEST(TestSmall, SwitchesRepresentation) {
+  using pa_t = persistent_array<int, base::Small<int, 8, base::Initial<int>>>;
+  pa_t pa;
+  std::vector<int> v;
+  std::vector<pa_t> versions;
+  std::vector<std::vector<int>> models;
+  for (int i = 0; i < 20; ++i) {
+    pa = pa.insert(i / 2, i);
+    v.insert(v.begin() + i / 2, i);
+    versions.push_back(pa);
+    models.push_back(v);
+    ASSERT_EQ(pa.to_vector(), v);
+  }
+  for (int i = 0; i < 20; ++i) {
+    pa = pa.update(i, -i);
+    v[i] = -i;
+  }
+  while (!v.empty()) {
+    size_t first = v.size() / 3;
+    size_t last = std::min(v.size(), first + 2);
+    pa = pa.erase(first, last);
+    v.erase(v.begin() + first, v.begin() + last);
+    ASSERT_EQ(pa.to_vector(), v);
+    ASSERT_EQ(pa, pa_t(v.begin(), v.end()));
+  }
+  for (size_t i = 0; i < versions.size(); ++i) {
+    ASSERT_EQ(versions[i].to_vector(), models[i]);
+  }
+}
+
+// Iterators compare by index in both forms, default-constructed ones too.
+TEST(TestSmall, IteratorComparisons) {
+  using pa_t = persistent_array<int, base::Small<int, 8>>;
+  for (int n : {5, 50}) {
+    std::vector<int> v(n);
+    std::iota(v.begin(), v.end(), 0);
+    pa_t pa(v.begin(), v.end());
+    ASSERT_EQ(std::distance(pa.begin(), pa.end()), n);
+    ASSERT_TRUE(std::equal(pa.begin(), pa.end(), v.begin(), v.end()));
+    auto it = pa.begin() + n / 2;
+    ASSERT_EQ(it - pa.begin(), n / 2);
+    ASSERT_LT(pa.begin(), it);
+    ASSERT_EQ(*it, n / 2);
+  }
+  pa_t::iterator a, b;
+  ASSERT_EQ(a, b);
+  ASSERT_EQ(a - b, 0);
+}
+
+template <typename Base>
+struct TestHistory : ::testing::Test {};
+
+// Every backend with intrusive reference counts.
+using HistoryTypes =
+    ::testing::Types<base::MySharedPtr<int>, base::FourFold<int>,
+                     base::EightFold<int>, base::Interned<int>,
+                     base::Packed<int>, base::Wide<int>>;
+TYPED_TEST_SUITE(TestHistory, HistoryTypes);
+
+TYPED_TEST(TestHistory, UndoRedo) {
+  history<int, TypeParam> h(persistent_array<int, TypeParam>(100, 0));
+  for (int i = 1; i <= 5; ++i) {
+    h.update(i, i);
+    h.checkpoint();
+  }
+  h.checkpoint();
+  ASSERT_EQ(h.size(), 6);
+  ASSERT_FALSE(h.redo());
+  for (int i = 5; i >= 1; --i) {
+    ASSERT_EQ(h.current()[i], i);
+    ASSERT_TRUE(h.undo());
+    ASSERT_EQ(h.current()[i], 0);
+  }
+  ASSERT_FALSE(h.undo());
+  ASSERT_TRUE(h.redo());
+  ASSERT_TRUE(h.redo());
+  ASSERT_EQ(h.current()[2], 2);
+  ASSERT_EQ(h.current()[3], 0);
+
+  // Uncheckpointed changes are dropped by undo.
+  h.update(50, 50);
+  ASSERT_TRUE(h.undo());
+  ASSERT_TRUE(h.redo());
+  ASSERT_EQ(h.current()[50], 0);
+}
+
+TYPED_TEST(TestHistory, Branches) {
+  history<int, TypeParam> h(persistent_array<int, TypeParam>(100, 0));
+  h.update(0, 1);
+  h.checkpoint();
+  ASSERT_TRUE(h.undo());
+  h.update(0, 2);
+  h.checkpoint();
+  ASSERT_TRUE(h.undo());
+  ASSERT_EQ(h.branches(), 2);
+  ASSERT_TRUE(h.redo());
+  ASSERT_EQ(h.current()[0], 2);
+  ASSERT_TRUE(h.undo());
+  ASSERT_TRUE(h.redo(0));
+  ASSERT_EQ(h.current()[0], 1);
+  ASSERT_TRUE(h.undo());
+  ASSERT_TRUE(h.redo());
+  ASSERT_EQ(h.current()[0], 1);
+  ASSERT_TRUE(h.undo());
+  ASSERT_FALSE(h.redo(2));
+}
+
+TYPED_TEST(TestHistory, Budget) {
+  using pa_t = persistent_array<int, TypeParam>;
+  const int N = 10000;
+  std::vector<int> v(N);
+  std::iota(v.begin(), v.end(), 0);
+  history<int, TypeParam> h(pa_t(v.begin(), v.end()));
+  size_t budget = h.nodes() + 200;
+  h.set_budget(budget);
+
+  std::mt19937 rnd{};
+  for (int i = 0; i < 1000; ++i) {
+    h.update(rnd() % N, -i);
+    auto dropped = h.checkpoint();
+    ASSERT_LE(h.nodes(), budget);
+    ASSERT_EQ(dropped.nodes == 0, dropped.bytes == 0);
+    if (i % 100 == 50) {
+      ASSERT_TRUE(h.undo());
+    }
+  }
+  ASSERT_GT(h.size(), 1);
+  ASSERT_LT(h.size(), 1000);
+
+  auto last = h.current();
+  while (h.undo()) {
+  }
+  while (h.redo()) {
+  }
+  ASSERT_EQ(h.current(), last);
+}
+
+TEST(TestHistory, DroppedIsExact) {
+  using base::stats::Counting;
+  using Base = base::EightFold<int, uint32_t, Counting>;
+  std::vector<int> v(1000);
+  std::iota(v.begin(), v.end(), 0);
+  history<int, Base> h(persistent_array<int, Base>(v.begin(), v.end()));
+  for (int i = 0; i < 50; ++i) {
+    h.update(i * 7, -i);
+    h.checkpoint();
+  }
+  h.undo();
+  h.undo();
+  h.update(3, 3);
+  h.checkpoint();
+  auto kept = h.current();
+
+  auto before = Counting::snapshot();
+  auto dropped = h.set_budget(0);
+  auto freed = Counting::snapshot() - before;
+  ASSERT_EQ(h.size(), 1);
+  ASSERT_EQ(dropped.checkpoints, 51);
+  ASSERT_EQ(dropped.nodes, freed.nodes_freed);
+  ASSERT_FALSE(h.undo());
+  ASSERT_EQ(h.current(), kept);
+}
+
+// Every value written survives in the last version, so the only values freed
+// are the ones it replaced; all other freed nodes are intermediate.
+TEST(TestHistory, DroppedBytesAreExact) {
+  using base::stats::Counting;
+  using Base = base::EightFold<int, uint32_t, Counting>;
+  const size_t K = 20;
+  std::vector<int> v(1000);
+  history<int, Base> h(persistent_array<int, Base>(v.begin(), v.end()));
+  for (size_t i = 0; i < K; ++i) {
+    h.update(i * 37, 1);
+    h.checkpoint();
+  }
+  auto before = Counting::snapshot();
+  auto dropped = h.set_budget(0);
+  auto freed = Counting::snapshot() - before;
+  ASSERT_EQ(dropped.checkpoints, K);
+  ASSERT_EQ(dropped.nodes, freed.nodes_freed);
+  using history_t = history<int, Base>;
+  size_t intermediate = freed.nodes_freed - K;
+  ASSERT_EQ(dropped.bytes, K * sizeof(Base::DataNode) +
+                               intermediate * sizeof(Base::IntermediateNode) +
+                               K * history_t::checkpoint_bytes(1));
+}
@@ -7,7 +7,11 @@ using MyTypes = ::testing::Types<
     base::Initial<T>,
     base::MySharedPtr<T>,
     base::FourFold<T>,
-    base::EightFold<T>
+    base::EightFold<T>,
+    base::Interned<T>,
+    base::Packed<T>,
+    base::Wide<T>,
+    base::Small<T>
     >;
 // clang-format on
 
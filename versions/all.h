@@ -1,5 +1,10 @@
 #pragma once
 
 #include "initial_base.h"
+#include "interned.h"
 #include "k_fold.h"
-#include "my_shared_ptr.h"
\ No newline at end of file
+#include "my_shared_ptr.h"
+#include "packed.h"
+#include "wide.h"
+#include "small.h"
+#include "auto.h"
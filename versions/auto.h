@@ -0,0 +1,49 @@
+#include <concepts>
+#include <type_traits>
+
+namespace base {
+
+enum class Workload { BALANCED, READ_HEAVY, UPDATE_HEAVY, SCAN_HEAVY };
+
+template <typename T>
+concept Packable = std::integral<T> && !std::same_as<T, bool>;
+
+// Backend choice measured with the Update, Read and Scan benchmarks of
+// benches/scaling.cpp (run_scaling_benches) at N = 1e6, random access, with
+// bytes_per_version counting blocks reused from the node caches:
+// - EightFold reads 15-40% faster than FourFold at every element size from
+//   4 to 256 bytes, and updates within about 20% of it either way;
+// - FourFold allocates the fewest bytes per new version (about 20% less than
+//   EightFold), which is what bounds workloads that keep many versions;
+// - up to 16 B Wide reads 35% (16 B) to 3x (4 B) faster than EightFold,
+//   scans 2-7x faster, updates as fast or faster and takes 2-7x less memory
+//   per element, but a version costs 25-45% more bytes since whole leaves
+//   are copied; from 64 B on a leaf holds one value and it loses everywhere;
+// - Packed reads and updates about as fast as Wide and faster than the
+//   trees, with as little memory per element, but only fits integral types
+//   and hands out values, not references.
+template <typename T, Workload W>
+struct AutoSelect {
+  using type = std::conditional_t<W == Workload::UPDATE_HEAVY, FourFold<T>,
+                                  EightFold<T>>;
+};
+
+// Leaves are copied on every update, so only cheaply copyable values go
+// inline, and not when versions are kept in bulk.
+template <typename T, Workload W>
+  requires(!Packable<T>) && (W != Workload::UPDATE_HEAVY) &&
+          (sizeof(T) <= 16) && std::is_trivially_copyable_v<T>
+struct AutoSelect<T, W> {
+  using type = Wide<T>;
+};
+
+template <typename T, Workload W>
+  requires Packable<T> && (W != Workload::UPDATE_HEAVY)
+struct AutoSelect<T, W> {
+  using type = Packed<T>;
+};
+
+template <typename T, Workload W = Workload::BALANCED>
+using Auto = typename AutoSelect<T, W>::type;
+
+}  // namespace base
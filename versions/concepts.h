@@ -0,0 +1,26 @@
+#pragma once
+
+#include <concepts>
+#include <cstddef>
+#include <iterator>
+
+namespace base {
+
+// Iterators whose distance can be taken without consuming them, which
+// includes std::move_iterator over contiguous storage.
+template <typename Iter>
+concept SizedIterator =
+    std::forward_iterator<Iter> ||
+    (std::input_iterator<Iter> && std::sized_sentinel_for<Iter, Iter>);
+
+// Backends that let history see their nodes: the root of a version, the
+// children of a node and the heap bytes a node takes.
+template <typename Base>
+concept Accountable =
+    requires(const Base& base, const typename Base::BaseNode* node) {
+      { base.root_node() } -> std::same_as<const typename Base::BaseNode*>;
+      { Base::node_bytes(node) } -> std::convertible_to<size_t>;
+      Base::for_each_child(node, [](const typename Base::BaseNode*) {});
+    };
+
+}  // namespace base
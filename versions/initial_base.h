@@ -1,25 +1,45 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <memory>
 #include <numeric>
+#include <type_traits>
+#include <unordered_map>
 
-#include "../inplace_vector"
+#include "concepts.h"
+#include "prefetch.h"
+#include "recycle.h"
+#include "stats.h"
 
 namespace base {
 
-template <typename T>
+template <typename T, typename Size = uint32_t,
+          typename Stats = stats::None>
 struct Initial {
   struct IntermediateNode;
   struct DataNode;
 
   struct BaseNode {
-    size_t size;
+    Size size;
+    [[no_unique_address]] typename Stats::Node tracker{};
   };
 
+  // Intermediate nodes keep a copy of their last value when it is small, so a
+  // search of a sorted version descends once; otherwise Key takes no space.
+  static constexpr bool KEYED =
+      std::is_trivially_copyable_v<T> && sizeof(T) <= sizeof(void*);
+  struct NoKey {};
+  using Key = std::conditional_t<KEYED, T, NoKey>;
+
   struct IntermediateNode : BaseNode {
+    [[no_unique_address]] Key last;
     std::shared_ptr<BaseNode> left, right;
 
     IntermediateNode(std::shared_ptr<BaseNode> left,
                      std::shared_ptr<BaseNode> right)
         : BaseNode(left->size + right->size),
+          last(last_of(right.get())),
           left(std::move(left)),
           right(std::move(right)) {}
   };
@@ -31,43 +51,92 @@ struct Initial {
     DataNode(Args&&... args) : BaseNode(1), x(std::forward<Args>(args)...) {}
   };
 
+  static Key last_of(const BaseNode* node) {
+    if constexpr (KEYED) {
+      if (node->size == 1) {
+        return static_cast<const DataNode*>(node)->x;
+      }
+      return static_cast<const IntermediateNode*>(node)->last;
+    } else {
+      return {};
+    }
+  }
+
+  // Node and control block share one allocation, recycled when freed.
+  template <typename Node, typename... Args>
+  static std::shared_ptr<BaseNode> make(Args&&... args) {
+    return std::allocate_shared<Node>(RecyclingAllocator<Node>{},
+                                      std::forward<Args>(args)...);
+  }
+
   std::shared_ptr<BaseNode> root;
 
-  size_t size() const { return root->size; }
+  size_t size() const { return root.get() ? root->size : 0; }
 
-  static constexpr size_t MAX_SIZE = UINT32_MAX;
+  static constexpr size_t MAX_SIZE = std::numeric_limits<Size>::max();
 
-  template <bool IsConst>
-  class BaseIterator {
-    static const size_t STACK_SIZE = std::bit_width(MAX_SIZE) + 1;
-    using StackType = std::inplace_vector<BaseNode*, STACK_SIZE>;
+  // Insertions and erasures keep the tree weight-balanced: the lighter child
+  // of every node holds at least ALPHA_PERCENT percent of its leaves, so each
+  // level down keeps at most 71% of them. join() is the weight-balanced join
+  // of Blelloch, Ferizovic and Sun, "Just Join for Parallel Ordered Sets",
+  // which holds the invariant for ALPHA up to 1 - 1/sqrt(2). Trees built by
+  // halving, as from_iter and filled do, are balanced already.
+  static constexpr size_t ALPHA_PERCENT = 29;
 
-    StackType stack;
+  static bool balanced(size_t a, size_t b) {
+    return 100 * std::min(a, b) >= ALPHA_PERCENT * (a + b);
+  }
 
+  template <bool IsConst>
+  class BaseIterator {
+    // A jump climbs only as far as the common ancestor of the old and new
+    // positions, which is rarely more than a few levels up, so only the
+    // deepest PATH_SIZE nodes of the path are kept, in a ring. A jump past
+    // them descends again from the root. Each node is stored with the index
+    // of its first leaf, so a copy is a fixed handful of words.
+    static const size_t PATH_SIZE = 8;
+
+    BaseNode* root = nullptr;
+    size_t index = 0;
+    std::array<BaseNode*, PATH_SIZE> path{};
+    std::array<Size, PATH_SIZE> starts{};
+    uint8_t top = 0;
+    uint8_t depth = 0;
+
+    template <bool>
+    friend class BaseIterator;
     friend class Initial;
 
-    void go_to_kth(size_t k) {
-      while (stack.back()->size > 1) {
-        auto intermediate_node = static_cast<IntermediateNode*>(stack.back());
-        if (intermediate_node->left->size > k) {
-          stack.push_back(intermediate_node->left.get());
+    void push(BaseNode* node, size_t start) {
+      top = (top + 1) % PATH_SIZE;
+      path[top] = node;
+      starts[top] = start;
+      depth += depth < PATH_SIZE;
+    }
+
+    void go_to_index() {
+      Stats::descent();
+      while (path[top]->size > 1) {
+        Stats::step();
+        auto intermediate_node = static_cast<IntermediateNode*>(path[top]);
+        // Fetched while the left child is loaded to pick a side.
+        prefetch(intermediate_node->right.get());
+        size_t start = starts[top] + intermediate_node->left->size;
+        if (index < start) {
+          push(intermediate_node->left.get(), starts[top]);
         } else {
-          k -= intermediate_node->left->size;
-          stack.push_back(intermediate_node->right.get());
+          push(intermediate_node->right.get(), start);
         }
       }
     }
 
-    BaseIterator(BaseNode* root, size_t index) : stack({root}) {
-      if (index < root->size) {
-        go_to_kth(index);
-      } else {
-        stack.push_back(nullptr);
+    BaseIterator(BaseNode* root, size_t index) : root(root), index(index) {
+      if (root && index < root->size) {
+        push(root, 0);
+        go_to_index();
       }
     }
 
-    explicit BaseIterator(const StackType& stack) : stack(stack) {}
-
    public:
     using iterator_category = std::random_access_iterator_tag;
     using difference_type = std::ptrdiff_t;
@@ -80,33 +149,30 @@ struct Initial {
     BaseIterator& operator=(const BaseIterator&) = default;
 
     reference operator*() const {
-      return static_cast<DataNode*>(stack.back())->x;
+      return static_cast<DataNode*>(path[top])->x;
     }
 
     pointer operator->() const {
-      return &static_cast<DataNode*>(stack.back())->x;
+      return &static_cast<DataNode*>(path[top])->x;
     }
 
     reference operator[](difference_type n) const { return *operator+(n); }
 
     BaseIterator& operator+=(difference_type n) {
-      difference_type k = n;
-      if (!stack.back()) {
-        stack.pop_back();
-        k += stack.back()->size;
+      Stats::jump();
+      index += n;
+      while (depth && index - starts[top] >= path[top]->size) {
+        top = (top + PATH_SIZE - 1) % PATH_SIZE;
+        --depth;
+        Stats::pop();
       }
-      while (stack.size() > 1 && !(0 <= k && k < stack.back()->size)) {
-        auto parent = static_cast<IntermediateNode*>(stack[stack.size() - 2]);
-        if (stack.back() == parent->right.get()) {
-          k += parent->left->size;
+      if (!depth) {
+        if (!root || index >= root->size) {
+          return *this;
         }
-        stack.pop_back();
-      }
-      if (0 <= k && k < stack.back()->size) {
-        go_to_kth(k);
-      } else {
-        stack.push_back(nullptr);
+        push(root, 0);
       }
+      go_to_index();
       return *this;
     }
 
@@ -141,114 +207,412 @@ struct Initial {
     }
 
     difference_type operator-(const BaseIterator& other) const {
-      size_t lca_depth = std::min(stack.size(), other.stack.size()) - 1;
-      while (stack[lca_depth] != other.stack[lca_depth]) {
-        --lca_depth;
-      }
-      auto lca_index = [&](const StackType& stack) {
-        if (!stack.back()) {
-          return stack[0]->size;
-        }
-        size_t result = 0;
-        for (size_t i = lca_depth; i + 1 < stack.size(); ++i) {
-          auto intermediate_node = static_cast<IntermediateNode*>(stack[i]);
-          if (intermediate_node->right.get() == stack[i + 1]) {
-            result += intermediate_node->left->size;
-          }
-        }
-        return result;
-      };
-      return lca_index(stack) - lca_index(other.stack);
+      return static_cast<difference_type>(index - other.index);
     }
 
     std::strong_ordering operator<=>(const BaseIterator& other) const {
-      return operator-(other) <=> 0;
+      return index <=> other.index;
     }
 
     bool operator==(const BaseIterator& other) const {
-      return stack.back() == other.stack.back();
+      return index == other.index;
     }
 
     friend BaseIterator operator+(difference_type i, const BaseIterator& iter) {
       return iter + i;
     }
 
-    explicit operator BaseIterator<true>() { return BaseIterator<true>(stack); }
+    explicit operator BaseIterator<true>() {
+      BaseIterator<true> result;
+      result.root = root;
+      result.index = index;
+      result.path = path;
+      result.starts = starts;
+      result.top = top;
+      result.depth = depth;
+      return result;
+    }
+  };
+
+  // A lookup that gather() advances one level at a time. The children of the
+  // current node are always prefetched, so a step only waits on memory that
+  // was requested a whole round of the group earlier.
+  struct Probe {
+    BaseNode* node;
+    size_t k;
   };
 
+  static void prefetch_children(BaseNode* node) {
+    auto intermediate_node = static_cast<IntermediateNode*>(node);
+    prefetch(intermediate_node->left.get());
+    prefetch(intermediate_node->right.get());
+  }
+
+  Probe probe(size_t i) const {
+    Stats::descent();
+    if (root->size != 1) {
+      prefetch_children(root.get());
+    }
+    return {root.get(), i};
+  }
+
+  static bool step(Probe& probe) {
+    if (probe.node->size == 1) {
+      return false;
+    }
+    Stats::step();
+    auto intermediate_node = static_cast<IntermediateNode*>(probe.node);
+    if (probe.k < intermediate_node->left->size) {
+      probe.node = intermediate_node->left.get();
+    } else {
+      probe.k -= intermediate_node->left->size;
+      probe.node = intermediate_node->right.get();
+    }
+    if (!(probe.node->size == 1)) {
+      prefetch_children(probe.node);
+    }
+    return true;
+  }
+
+  static const T& value(const Probe& probe) {
+    return static_cast<DataNode*>(probe.node)->x;
+  }
+
   explicit Initial(std::shared_ptr<BaseNode> root) : root(std::move(root)) {}
 
   BaseIterator<true> begin() const { return {root.get(), 0}; }
 
   BaseIterator<true> end() const { return {root.get(), size()}; }
 
-  BaseIterator<false> mutable_begin() { return {root.get(), 0}; }
-
-  BaseIterator<false> mutable_end() { return {root.get(), size()}; }
-
   template <std::input_iterator Iter>
   static std::shared_ptr<BaseNode> build_from_iter(size_t l, size_t r,
                                                    Iter& iter) {
-    if (l + 1 == r) {
-      return std::make_shared<DataNode>(*iter++);
+    if (l == r) {
+      return {};
+    } else if (l + 1 == r) {
+      return make<DataNode>(*iter++);
     } else {
       size_t m = std::midpoint(l, r);
       auto left = build_from_iter(l, m, iter);
       auto right = build_from_iter(m, r, iter);
-      return std::make_shared<IntermediateNode>(std::move(left),
-                                                std::move(right));
+      return make<IntermediateNode>(std::move(left), std::move(right));
     }
   }
 
-  static std::shared_ptr<BaseNode> build_filled(size_t l, size_t r,
-                                                const T& fill) {
-    if (l + 1 == r) {
-      return std::make_shared<DataNode>(fill);
-    } else {
-      size_t m = std::midpoint(l, r);
-      auto left = build_filled(l, m, fill);
-      auto right = build_filled(m, r, fill);
-      return std::make_shared<IntermediateNode>(std::move(left),
-                                                std::move(right));
+  // Filled subtrees of the same size are identical, so every size is built
+  // once and shared.
+  static std::shared_ptr<BaseNode> build_filled(
+      size_t size, const T& fill,
+      std::unordered_map<size_t, std::shared_ptr<BaseNode>>& built) {
+    if (size == 0) {
+      return nullptr;
     }
+    auto it = built.find(size);
+    if (it == built.end()) {
+      std::shared_ptr<BaseNode> node;
+      if (size == 1) {
+        node = make<DataNode>(fill);
+      } else {
+        auto left = build_filled(size / 2, fill, built);
+        auto right = build_filled(size - size / 2, fill, built);
+        node = make<IntermediateNode>(std::move(left), std::move(right));
+      }
+      it = built.emplace(size, std::move(node)).first;
+    }
+    return it->second;
   }
 
   template <typename... Args>
   std::shared_ptr<BaseNode> updated_node(BaseNode* curr, size_t i,
                                          Args&&... args) const {
     if (curr->size == 1) {
-      return std::make_shared<DataNode>(std::forward<Args>(args)...);
+      return make<DataNode>(std::forward<Args>(args)...);
     }
+    Stats::step();
     auto intermediate_node = static_cast<IntermediateNode*>(curr);
     if (i < intermediate_node->left->size) {
       auto new_left = updated_node(intermediate_node->left.get(), i,
                                    std::forward<Args>(args)...);
-      return std::make_shared<IntermediateNode>(std::move(new_left),
-                                                intermediate_node->right);
+      return make<IntermediateNode>(std::move(new_left),
+                                    intermediate_node->right);
     } else {
       auto new_right = updated_node(intermediate_node->right.get(),
                                     i - intermediate_node->left->size,
                                     std::forward<Args>(args)...);
-      return std::make_shared<IntermediateNode>(intermediate_node->left,
-                                                std::move(new_right));
+      return make<IntermediateNode>(intermediate_node->left,
+                                    std::move(new_right));
+    }
+  }
+
+  // A node only this version points to. use_count() is a relaxed load, so
+  // the fence orders what follows after the release of the last other
+  // owner, which may have been on another thread.
+  static bool unique(const std::shared_ptr<BaseNode>& node) {
+    if (node.use_count() != 1) {
+      return false;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return true;
+  }
+
+  // Path copying that reuses nodes nothing else points to: they are changed
+  // in place, and copying starts at the first shared node.
+  template <typename... Args>
+  void update_in_place(std::shared_ptr<BaseNode>& node, size_t i,
+                       Args&&... args) {
+    if (!unique(node)) {
+      node = updated_node(node.get(), i, std::forward<Args>(args)...);
+    } else if (node->size == 1) {
+      static_cast<DataNode*>(node.get())->x = T(std::forward<Args>(args)...);
+    } else {
+      Stats::step();
+      auto intermediate_node = static_cast<IntermediateNode*>(node.get());
+      if (i < intermediate_node->left->size) {
+        update_in_place(intermediate_node->left, i,
+                        std::forward<Args>(args)...);
+      } else {
+        update_in_place(intermediate_node->right,
+                        i - intermediate_node->left->size,
+                        std::forward<Args>(args)...);
+        intermediate_node->last = last_of(intermediate_node->right.get());
+      }
     }
   }
 
+  // Replaces a shared node with a copy that only this version points to. The
+  // copy shares the children, which are copied in turn when written.
+  static void own(std::shared_ptr<BaseNode>& node) {
+    if (unique(node)) {
+      return;
+    }
+    if (node->size == 1) {
+      node = make<DataNode>(static_cast<DataNode*>(node.get())->x);
+    } else {
+      auto intermediate_node = static_cast<IntermediateNode*>(node.get());
+      node = make<IntermediateNode>(intermediate_node->left,
+                                    intermediate_node->right);
+    }
+  }
+
+  // Calls fn on the values at positions [l, r) of node, in order.
+  template <typename Fn>
+  static void modify_node(std::shared_ptr<BaseNode>& node, size_t l,
+                          size_t r, Fn& fn) {
+    own(node);
+    if (node->size == 1) {
+      fn(static_cast<DataNode*>(node.get())->x);
+      return;
+    }
+    Stats::step();
+    auto intermediate_node = static_cast<IntermediateNode*>(node.get());
+    size_t middle = intermediate_node->left->size;
+    if (l < middle) {
+      modify_node(intermediate_node->left, l, std::min(r, middle), fn);
+    }
+    if (middle < r) {
+      modify_node(intermediate_node->right, std::max(l, middle) - middle,
+                  r - middle, fn);
+      intermediate_node->last = last_of(intermediate_node->right.get());
+    }
+  }
+
+  using Ptr = std::shared_ptr<BaseNode>;
+
+  static Ptr make_intermediate(Ptr left, Ptr right) {
+    return make<IntermediateNode>(std::move(left), std::move(right));
+  }
+
+  // Concatenates two balanced trees, either of which may be empty.
+  static Ptr join(Ptr left, Ptr right) {
+    if (!left) {
+      return right;
+    }
+    if (!right) {
+      return left;
+    }
+    if (balanced(left->size, right->size)) {
+      return make_intermediate(std::move(left), std::move(right));
+    }
+    if (left->size > right->size) {
+      auto heavy = static_cast<IntermediateNode*>(left.get());
+      return rotated_left(heavy->left, join(heavy->right, std::move(right)));
+    }
+    auto heavy = static_cast<IntermediateNode*>(right.get());
+    return rotated_right(join(std::move(left), heavy->left), heavy->right);
+  }
+
+  // A node over left and right, where right may have grown too heavy for
+  // left; restored by a single or a double rotation.
+  static Ptr rotated_left(Ptr left, Ptr right) {
+    if (balanced(left->size, right->size)) {
+      return make_intermediate(std::move(left), std::move(right));
+    }
+    auto heavy = static_cast<IntermediateNode*>(right.get());
+    size_t inner_size = heavy->left->size;
+    if (balanced(left->size, inner_size) &&
+        balanced(left->size + inner_size, heavy->right->size)) {
+      return make_intermediate(
+          make_intermediate(std::move(left), heavy->left), heavy->right);
+    }
+    auto inner = static_cast<IntermediateNode*>(heavy->left.get());
+    return make_intermediate(make_intermediate(std::move(left), inner->left),
+                             make_intermediate(inner->right, heavy->right));
+  }
+
+  static Ptr rotated_right(Ptr left, Ptr right) {
+    if (balanced(left->size, right->size)) {
+      return make_intermediate(std::move(left), std::move(right));
+    }
+    auto heavy = static_cast<IntermediateNode*>(left.get());
+    size_t inner_size = heavy->right->size;
+    if (balanced(inner_size, right->size) &&
+        balanced(heavy->left->size, inner_size + right->size)) {
+      return make_intermediate(
+          heavy->left, make_intermediate(heavy->right, std::move(right)));
+    }
+    auto inner = static_cast<IntermediateNode*>(heavy->right.get());
+    return make_intermediate(make_intermediate(heavy->left, inner->left),
+                             make_intermediate(inner->right, std::move(right)));
+  }
+
+  // The first k leaves of node and the rest, as balanced trees.
+  static std::pair<Ptr, Ptr> split(const Ptr& node, size_t k) {
+    if (k == 0) {
+      return {nullptr, node};
+    }
+    if (k == node->size) {
+      return {node, nullptr};
+    }
+    auto intermediate_node = static_cast<IntermediateNode*>(node.get());
+    size_t middle = intermediate_node->left->size;
+    if (k < middle) {
+      auto [left, right] = split(intermediate_node->left, k);
+      return {std::move(left),
+              join(std::move(right), intermediate_node->right)};
+    }
+    auto [left, right] = split(intermediate_node->right, k - middle);
+    return {join(intermediate_node->left, std::move(left)), std::move(right)};
+  }
+
+  static bool equal_nodes(BaseNode* a, BaseNode* b) {
+    if (a == b) {
+      return true;
+    }
+    if (!a || !b || a->size != b->size) {
+      return false;
+    }
+    if (a->size == 1) {
+      return static_cast<DataNode*>(a)->x == static_cast<DataNode*>(b)->x;
+    }
+    auto a_node = static_cast<IntermediateNode*>(a);
+    auto b_node = static_cast<IntermediateNode*>(b);
+    // Insertions and erasures can give equal contents different shapes.
+    if (a_node->left->size != b_node->left->size) {
+      BaseIterator<true> a_begin(a, 0), a_end(a, a->size), b_begin(b, 0);
+      return std::equal(a_begin, a_end, b_begin);
+    }
+    return equal_nodes(a_node->left.get(), b_node->left.get()) &&
+           equal_nodes(a_node->right.get(), b_node->right.get());
+  }
+
+  // Copies positions [l, r) of the subtree at node to out.
+  static T* copy_node(BaseNode* node, size_t l, size_t r, T* out) {
+    if (node->size == 1) {
+      *out = static_cast<DataNode*>(node)->x;
+      return out + 1;
+    }
+    auto intermediate_node = static_cast<IntermediateNode*>(node);
+    size_t middle = intermediate_node->left->size;
+    if (l < middle) {
+      out = copy_node(intermediate_node->left.get(), l, std::min(r, middle),
+                      out);
+    }
+    if (middle < r) {
+      out = copy_node(intermediate_node->right.get(),
+                      std::max(l, middle) - middle, r - middle, out);
+    }
+    return out;
+  }
+
   static Initial filled(size_t count, const T& fill) {
-    return Initial{build_filled(0, count, fill)};
+    std::unordered_map<size_t, std::shared_ptr<BaseNode>> built;
+    return Initial{build_filled(count, fill, built)};
   }
 
-  template <std::forward_iterator Iter>
+  template <SizedIterator Iter>
   static Initial from_iter(Iter first, Iter last) {
-    return Initial{build_from_iter(0, std::distance(first, last), first)};
+    size_t count = std::ranges::distance(first, last);
+    return Initial{build_from_iter(0, count, first)};
   }
 
   template <typename... Args>
-  Initial update(size_t index, Args&&... args) const {
+  Initial update(size_t index, Args&&... args) const& {
+    Stats::descent();
     auto new_root =
         updated_node(root.get(), index, std::forward<Args>(args)...);
     return Initial{std::move(new_root)};
   }
+
+  template <typename... Args>
+  Initial update(size_t index, Args&&... args) && {
+    Stats::descent();
+    update_in_place(root, index, std::forward<Args>(args)...);
+    return std::move(*this);
+  }
+
+  // Writes through fn into the nodes of [first, last), copying those other
+  // versions share first.
+  template <typename Fn>
+  Initial modify_range(size_t first, size_t last, Fn& fn) && {
+    if (first != last) {
+      Stats::descent();
+      modify_node(root, first, last, fn);
+    }
+    return std::move(*this);
+  }
+
+  // Replaces positions [first, last) with the contents of inserted in
+  // O(log n) time.
+  Initial splice(size_t first, size_t last, const Initial& inserted) const {
+    auto [left, rest] = split(root, first);
+    auto right = split(rest, last - first).second;
+    return Initial{
+        join(join(std::move(left), inserted.root), std::move(right))};
+  }
+
+  T* copy_to(size_t first, size_t last, T* out) const {
+    return first == last ? out : copy_node(root.get(), first, last, out);
+  }
+
+  // The number of leading values that satisfy pred, which must hold for a
+  // prefix of the array: one descent, testing the last value of each left
+  // subtree.
+  template <typename Pred>
+    requires KEYED
+  size_t partition_point(Pred pred) const {
+    if (!root) {
+      return 0;
+    }
+    Stats::descent();
+    size_t index = 0;
+    BaseNode* node = root.get();
+    while (node->size > 1) {
+      Stats::step();
+      auto intermediate_node = static_cast<IntermediateNode*>(node);
+      BaseNode* left = intermediate_node->left.get();
+      if (pred(last_of(left))) {
+        index += left->size;
+        node = intermediate_node->right.get();
+      } else {
+        node = left;
+      }
+    }
+    return index + pred(static_cast<const DataNode*>(node)->x);
+  }
+
+  bool operator==(const Initial& other) const {
+    return equal_nodes(root.get(), other.root.get());
+  }
 };
 
 }  // namespace base
\ No newline at end of file
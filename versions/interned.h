@@ -0,0 +1,506 @@
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <numeric>
+#include <unordered_map>
+
+#include "concepts.h"
+#include "prefetch.h"
+#include "recycle.h"
+#include "stats.h"
+
+namespace base {
+
+// Hash-consed binary tree: equal leaves and equal subtrees are shared by every
+// version, so identical versions end up with the very same root node.
+template <typename T, typename Size = uint32_t,
+          typename Stats = stats::None>
+struct Interned {
+  struct BaseNode {
+    Size size;
+    size_t hash;
+    std::atomic<size_t> ref_count = 1;
+    [[no_unique_address]] typename Stats::Node tracker{};
+  };
+
+  class Rc;
+
+  struct IntermediateNode : BaseNode, Recycled<IntermediateNode> {
+    Rc left, right;
+
+    IntermediateNode(size_t hash, Rc left, Rc right)
+        : BaseNode{left->size + right->size, hash},
+          left(std::move(left)),
+          right(std::move(right)) {}
+  };
+
+  struct DataNode : BaseNode, Recycled<DataNode> {
+    T x;
+
+    DataNode(size_t hash, T x) : BaseNode{1, hash}, x(std::move(x)) {}
+  };
+
+  static size_t mix(size_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  static size_t combine(size_t left, size_t right) {
+    return mix(left * 0x9e3779b97f4a7c15ULL + right);
+  }
+
+  // Weak table of all live nodes. It never owns a node: the last Rc to a node
+  // removes it from the table before deleting it.
+  class Table {
+    static constexpr size_t SHARDS = 64;
+
+    struct Shard {
+      std::mutex mutex;
+      std::unordered_multimap<size_t, BaseNode*> nodes;
+    };
+
+    std::array<Shard, SHARDS> shards;
+
+    static bool try_acquire(BaseNode* node) {
+      size_t count = node->ref_count.load(std::memory_order_relaxed);
+      while (count != 0) {
+        if (node->ref_count.compare_exchange_weak(count, count + 1,
+                                                  std::memory_order_relaxed)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+   public:
+    static Table& instance() {
+      static Table* table = new Table;
+      return *table;
+    }
+
+    template <typename Matches, typename Make>
+    BaseNode* intern(size_t hash, Matches matches, Make make) {
+      auto& shard = shards[hash % SHARDS];
+      std::lock_guard lock(shard.mutex);
+      auto [first, last] = shard.nodes.equal_range(hash);
+      for (auto it = first; it != last; ++it) {
+        if (matches(it->second) && try_acquire(it->second)) {
+          return it->second;
+        }
+      }
+      BaseNode* node = make();
+      shard.nodes.emplace(hash, node);
+      return node;
+    }
+
+    void erase(BaseNode* node) {
+      auto& shard = shards[node->hash % SHARDS];
+      std::lock_guard lock(shard.mutex);
+      auto [first, last] = shard.nodes.equal_range(node->hash);
+      for (auto it = first; it != last; ++it) {
+        if (it->second == node) {
+          shard.nodes.erase(it);
+          return;
+        }
+      }
+    }
+  };
+
+  class Rc {
+   private:
+    BaseNode* ptr = nullptr;
+
+    Rc(BaseNode* raw) : ptr(raw) {}
+
+   public:
+    Rc(const Rc& rc) : ptr(rc.ptr) {
+      if (!ptr) {
+        return;
+      }
+      ptr->ref_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Rc(Rc&& rc) noexcept : ptr(rc.ptr) { rc.ptr = nullptr; }
+
+    void swap(Rc& rc) { std::swap(ptr, rc.ptr); }
+
+    Rc& operator=(const Rc& rc) {
+      Rc{rc}.swap(*this);
+      return *this;
+    }
+
+    Rc& operator=(Rc&& rc) noexcept {
+      Rc{std::move(rc)}.swap(*this);
+      return *this;
+    }
+
+    ~Rc() {
+      if (!ptr) {
+        return;
+      }
+      if (ptr->ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        Table::instance().erase(ptr);
+        if (ptr->size == 1) {
+          delete static_cast<DataNode*>(ptr);
+        } else {
+          delete static_cast<IntermediateNode*>(ptr);
+        }
+      }
+    }
+
+    BaseNode* operator->() const { return ptr; }
+
+    BaseNode& operator*() const { return *ptr; }
+
+    BaseNode* get() const { return ptr; }
+
+    template <typename... Args>
+    static Rc make_base(Args&&... args) {
+      T x(std::forward<Args>(args)...);
+      size_t hash = mix(std::hash<T>{}(x));
+      return {Table::instance().intern(
+          hash,
+          [&](BaseNode* node) {
+            return node->size == 1 && static_cast<DataNode*>(node)->x == x;
+          },
+          [&] { return new DataNode(hash, std::move(x)); })};
+    }
+
+    static Rc make_intermediate(Rc left, Rc right) {
+      size_t hash = combine(left->hash, right->hash);
+      return {Table::instance().intern(
+          hash,
+          [&](BaseNode* node) {
+            auto intermediate_node = static_cast<IntermediateNode*>(node);
+            return node->size > 1 &&
+                   intermediate_node->left.get() == left.get() &&
+                   intermediate_node->right.get() == right.get();
+          },
+          [&] {
+            return new IntermediateNode(hash, std::move(left),
+                                        std::move(right));
+          })};
+    }
+
+    Rc() = default;
+  };
+
+  Rc root;
+
+  size_t size() const { return root.get() ? root->size : 0; }
+
+  static constexpr size_t MAX_SIZE = std::numeric_limits<Size>::max();
+
+  template <bool IsConst>
+  class BaseIterator {
+    // A jump climbs only as far as the common ancestor of the old and new
+    // positions, which is rarely more than a few levels up, so only the
+    // deepest PATH_SIZE nodes of the path are kept, in a ring. A jump past
+    // them descends again from the root. Each node is stored with the index
+    // of its first leaf, so a copy is a fixed handful of words.
+    static const size_t PATH_SIZE = 8;
+
+    BaseNode* root = nullptr;
+    size_t index = 0;
+    std::array<BaseNode*, PATH_SIZE> path{};
+    std::array<Size, PATH_SIZE> starts{};
+    uint8_t top = 0;
+    uint8_t depth = 0;
+
+    friend struct Interned;
+
+    void push(BaseNode* node, size_t start) {
+      top = (top + 1) % PATH_SIZE;
+      path[top] = node;
+      starts[top] = start;
+      depth += depth < PATH_SIZE;
+    }
+
+    void go_to_index() {
+      Stats::descent();
+      while (path[top]->size > 1) {
+        Stats::step();
+        auto intermediate_node = static_cast<IntermediateNode*>(path[top]);
+        // Fetched while the left child is loaded to pick a side.
+        prefetch(intermediate_node->right.get());
+        size_t start = starts[top] + intermediate_node->left->size;
+        if (index < start) {
+          push(intermediate_node->left.get(), starts[top]);
+        } else {
+          push(intermediate_node->right.get(), start);
+        }
+      }
+    }
+
+    BaseIterator(BaseNode* root, size_t index) : root(root), index(index) {
+      if (root && index < root->size) {
+        push(root, 0);
+        go_to_index();
+      }
+    }
+
+   public:
+    using iterator_category = std::random_access_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = std::conditional_t<IsConst, const T, T>;
+    using pointer = value_type*;
+    using reference = value_type&;
+
+    BaseIterator() = default;
+    BaseIterator(const BaseIterator&) = default;
+    BaseIterator& operator=(const BaseIterator&) = default;
+
+    reference operator*() const {
+      return static_cast<DataNode*>(path[top])->x;
+    }
+
+    pointer operator->() const {
+      return &static_cast<DataNode*>(path[top])->x;
+    }
+
+    reference operator[](difference_type n) const { return *operator+(n); }
+
+    BaseIterator& operator+=(difference_type n) {
+      Stats::jump();
+      index += n;
+      while (depth && index - starts[top] >= path[top]->size) {
+        top = (top + PATH_SIZE - 1) % PATH_SIZE;
+        --depth;
+        Stats::pop();
+      }
+      if (!depth) {
+        if (!root || index >= root->size) {
+          return *this;
+        }
+        push(root, 0);
+      }
+      go_to_index();
+      return *this;
+    }
+
+    BaseIterator& operator-=(difference_type n) { return operator+=(-n); }
+
+    BaseIterator operator+(difference_type n) const {
+      BaseIterator result = *this;
+      result += n;
+      return result;
+    }
+
+    BaseIterator operator-(difference_type n) const {
+      BaseIterator result = *this;
+      result -= n;
+      return result;
+    }
+
+    BaseIterator& operator++() { return operator+=(1); }
+
+    BaseIterator operator++(int) {
+      BaseIterator copy = *this;
+      operator++();
+      return copy;
+    }
+
+    BaseIterator& operator--() { return operator-=(1); }
+
+    BaseIterator operator--(int) {
+      BaseIterator copy = *this;
+      operator--();
+      return copy;
+    }
+
+    difference_type operator-(const BaseIterator& other) const {
+      return static_cast<difference_type>(index - other.index);
+    }
+
+    std::strong_ordering operator<=>(const BaseIterator& other) const {
+      return index <=> other.index;
+    }
+
+    bool operator==(const BaseIterator& other) const {
+      return index == other.index;
+    }
+
+    friend BaseIterator operator+(difference_type i, const BaseIterator& iter) {
+      return iter + i;
+    }
+  };
+
+  // A lookup that gather() advances one level at a time. The children of the
+  // current node are always prefetched, so a step only waits on memory that
+  // was requested a whole round of the group earlier.
+  struct Probe {
+    BaseNode* node;
+    size_t k;
+  };
+
+  static void prefetch_children(BaseNode* node) {
+    auto intermediate_node = static_cast<IntermediateNode*>(node);
+    prefetch(intermediate_node->left.get());
+    prefetch(intermediate_node->right.get());
+  }
+
+  Probe probe(size_t i) const {
+    Stats::descent();
+    if (root->size != 1) {
+      prefetch_children(root.get());
+    }
+    return {root.get(), i};
+  }
+
+  static bool step(Probe& probe) {
+    if (probe.node->size == 1) {
+      return false;
+    }
+    Stats::step();
+    auto intermediate_node = static_cast<IntermediateNode*>(probe.node);
+    if (probe.k < intermediate_node->left->size) {
+      probe.node = intermediate_node->left.get();
+    } else {
+      probe.k -= intermediate_node->left->size;
+      probe.node = intermediate_node->right.get();
+    }
+    if (!(probe.node->size == 1)) {
+      prefetch_children(probe.node);
+    }
+    return true;
+  }
+
+  static const T& value(const Probe& probe) {
+    return static_cast<DataNode*>(probe.node)->x;
+  }
+
+  explicit Interned(Rc root) : root(std::move(root)) {}
+
+  BaseIterator<true> begin() const { return {root.get(), 0}; }
+
+  BaseIterator<true> end() const { return {root.get(), size()}; }
+
+  template <std::input_iterator Iter>
+  static Rc build_from_iter(size_t l, size_t r, Iter& iter) {
+    if (l == r) {
+      return Rc{};
+    } else if (l + 1 == r) {
+      return Rc::make_base(*iter++);
+    } else {
+      size_t m = std::midpoint(l, r);
+      auto left = build_from_iter(l, m, iter);
+      auto right = build_from_iter(m, r, iter);
+      return Rc::make_intermediate(std::move(left), std::move(right));
+    }
+  }
+
+  // Filled subtrees of the same size are identical, so every size is built
+  // once and shared.
+  static Rc build_filled(size_t size, const T& fill,
+                         std::unordered_map<size_t, Rc>& built) {
+    if (size == 0) {
+      return Rc{};
+    }
+    auto it = built.find(size);
+    if (it == built.end()) {
+      auto node = size == 1 ? Rc::make_base(fill)
+                            : Rc::make_intermediate(
+                                  build_filled(size / 2, fill, built),
+                                  build_filled(size - size / 2, fill, built));
+      it = built.emplace(size, std::move(node)).first;
+    }
+    return it->second;
+  }
+
+  template <typename... Args>
+  Rc updated_node(BaseNode* curr, size_t i, Args&&... args) const {
+    if (curr->size == 1) {
+      return Rc::make_base(std::forward<Args>(args)...);
+    }
+    Stats::step();
+    auto intermediate_node = static_cast<IntermediateNode*>(curr);
+    if (i < intermediate_node->left->size) {
+      auto new_left = updated_node(intermediate_node->left.get(), i,
+                                   std::forward<Args>(args)...);
+      return Rc::make_intermediate(std::move(new_left),
+                                   intermediate_node->right);
+    } else {
+      auto new_right = updated_node(intermediate_node->right.get(),
+                                    i - intermediate_node->left->size,
+                                    std::forward<Args>(args)...);
+      return Rc::make_intermediate(intermediate_node->left,
+                                   std::move(new_right));
+    }
+  }
+
+  // Copies positions [l, r) of the subtree at node to out.
+  static T* copy_node(BaseNode* node, size_t l, size_t r, T* out) {
+    if (node->size == 1) {
+      *out = static_cast<DataNode*>(node)->x;
+      return out + 1;
+    }
+    auto intermediate_node = static_cast<IntermediateNode*>(node);
+    size_t middle = intermediate_node->left->size;
+    if (l < middle) {
+      out = copy_node(intermediate_node->left.get(), l, std::min(r, middle),
+                      out);
+    }
+    if (middle < r) {
+      out = copy_node(intermediate_node->right.get(),
+                      std::max(l, middle) - middle, r - middle, out);
+    }
+    return out;
+  }
+
+  // Node accounting for history: the nodes a version holds and what each of
+  // them takes on the heap.
+  const BaseNode* root_node() const { return root.get(); }
+
+  template <typename F>
+  static void for_each_child(const BaseNode* node, F f) {
+    if (node->size == 1) {
+      return;
+    }
+    auto intermediate_node = static_cast<const IntermediateNode*>(node);
+    f(intermediate_node->left.get());
+    f(intermediate_node->right.get());
+  }
+
+  // Includes the node's entry in the table: a bucket link and the pair.
+  static size_t node_bytes(const BaseNode* node) {
+    size_t entry = sizeof(void*) + sizeof(std::pair<const size_t, BaseNode*>);
+    return entry +
+           (node->size == 1 ? sizeof(DataNode) : sizeof(IntermediateNode));
+  }
+
+  static Interned filled(size_t count, const T& fill) {
+    std::unordered_map<size_t, Rc> built;
+    return Interned{build_filled(count, fill, built)};
+  }
+
+  template <SizedIterator Iter>
+  static Interned from_iter(Iter first, Iter last) {
+    size_t count = std::ranges::distance(first, last);
+    return Interned{build_from_iter(0, count, first)};
+  }
+
+  template <typename... Args>
+  Interned update(size_t index, Args&&... args) const {
+    Stats::descent();
+    auto new_root =
+        updated_node(root.get(), index, std::forward<Args>(args)...);
+    return Interned{std::move(new_root)};
+  }
+
+  T* copy_to(size_t first, size_t last, T* out) const {
+    return first == last ? out : copy_node(root.get(), first, last, out);
+  }
+
+  // Equal contents are always interned into the same root.
+  bool operator==(const Interned& other) const {
+    return root.get() == other.root.get();
+  }
+
+  size_t hash() const { return root.get() ? root->hash : 0; }
+};
+
+}  // namespace base
@@ -1,28 +1,61 @@
+#include <array>
+#include <cstdint>
 #include <numeric>
+#include <unordered_map>
+#include <utility>
 
-#include "../inplace_vector"
+#include "concepts.h"
+#include "prefetch.h"
+#include "recycle.h"
+#include "stats.h"
 
 namespace base {
 
-template <typename T, int B>
+template <typename T, int B, typename Size = uint32_t,
+          typename Stats = stats::None>
 struct KFold {
   static const int K = 1 << B;
 
   struct BaseNode {
-    size_t size;
-    size_t ref_count = 1;
+    Size size;
+    uint32_t ref_count = 1;
+    [[no_unique_address]] typename Stats::Node tracker{};
+  };
+
+  // Node pointer with the low bit set for DataNode, so the descent can tell a
+  // leaf from an intermediate node without loading it.
+  class NodePtr {
+    uintptr_t bits = 0;
+
+   public:
+    NodePtr() = default;
+
+    NodePtr(BaseNode* node, bool is_leaf)
+        : bits(reinterpret_cast<uintptr_t>(node) | is_leaf) {}
+
+    BaseNode* get() const {
+      return reinterpret_cast<BaseNode*>(bits & ~uintptr_t{1});
+    }
+
+    BaseNode* operator->() const { return get(); }
+
+    bool is_leaf() const { return bits & 1; }
+
+    explicit operator bool() const { return bits; }
+
+    bool operator==(const NodePtr&) const = default;
   };
 
   class Rc;
 
-  struct IntermediateNode : BaseNode {
+  struct IntermediateNode : BaseNode, Recycled<IntermediateNode> {
     std::array<Rc, K> children;
 
     IntermediateNode(size_t size, std::array<Rc, K> c)
         : BaseNode(size), children(std::move(c)) {}
   };
 
-  struct DataNode : BaseNode {
+  struct DataNode : BaseNode, Recycled<DataNode> {
     T x;
 
     template <typename... Args>
@@ -31,9 +64,9 @@ struct KFold {
 
   class Rc {
    private:
-    BaseNode* ptr = nullptr;
+    NodePtr ptr;
 
-    Rc(BaseNode* raw) : ptr(raw) {}
+    Rc(NodePtr raw) : ptr(raw) {}
 
    public:
     Rc(const Rc& rc) : ptr(rc.ptr) {
@@ -43,7 +76,7 @@ struct KFold {
       ptr->ref_count += 1;
     }
 
-    Rc(Rc&& rc) noexcept : ptr(rc.ptr) { rc.ptr = nullptr; }
+    Rc(Rc&& rc) noexcept : ptr(rc.ptr) { rc.ptr = {}; }
 
     void swap(Rc& rc) { std::swap(ptr, rc.ptr); }
 
@@ -63,27 +96,45 @@ struct KFold {
       }
       ptr->ref_count -= 1;
       if (ptr->ref_count == 0) {
-        if (ptr->size == 1) {
-          delete static_cast<DataNode*>(ptr);
+        if (ptr.is_leaf()) {
+          delete static_cast<DataNode*>(ptr.get());
         } else {
-          delete static_cast<IntermediateNode*>(ptr);
+          delete static_cast<IntermediateNode*>(ptr.get());
         }
       }
     }
 
-    BaseNode* operator->() const { return ptr; }
+    BaseNode* operator->() const { return ptr.get(); }
 
-    BaseNode& operator*() const { return *ptr; }
+    BaseNode& operator*() const { return *ptr.get(); }
 
-    BaseNode* get() const { return ptr; }
+    NodePtr get() const { return ptr; }
 
     template <typename... Args>
     static Rc make_base(Args&&... args) {
-      return {new DataNode(std::forward<Args>(args)...)};
+      return {{new DataNode(std::forward<Args>(args)...), true}};
+    }
+
+    // children with the one at index swapped for child. The pointers are
+    // copied as a block and only the children kept gain a reference, instead
+    // of copying each Rc and then releasing the replaced one.
+    static std::array<Rc, K> replaced(const std::array<Rc, K>& children,
+                                      size_t index, Rc child) {
+      std::array<Rc, K> result;
+      for (size_t j = 0; j < K; ++j) {
+        result[j].ptr = children[j].ptr;
+      }
+      for (size_t j = 0; j < K; ++j) {
+        if (j != index && result[j].ptr) {
+          result[j].ptr->ref_count += 1;
+        }
+      }
+      result[index].ptr = std::exchange(child.ptr, {});
+      return result;
     }
 
     static Rc make_intermediate(size_t size, std::array<Rc, K> c) {
-      return {new IntermediateNode(size, std::move(c))};
+      return {{new IntermediateNode(size, std::move(c)), false}};
     }
 
     Rc() = default;
@@ -91,43 +142,58 @@ struct KFold {
 
   Rc root;
 
-  size_t size() const { return root->size; }
+  size_t size() const { return root.get() ? root->size : 0; }
 
-  static constexpr size_t MAX_SIZE = UINT32_MAX;
+  static constexpr size_t MAX_SIZE = std::numeric_limits<Size>::max();
 
-  static size_t child_size(size_t n) { return (n + K - 1) / K; }
+  static size_t child_size(size_t n) { return n / K + (n % K != 0); }
 
   static size_t which(size_t i, size_t n) { return i / child_size(n); }
 
   template <bool IsConst>
   class BaseIterator {
-    static const size_t STACK_SIZE = (std::bit_width(MAX_SIZE) + 2 * B - 1) / B;
-    using StackType = std::inplace_vector<BaseNode*, STACK_SIZE>;
-
-    StackType stack;
-    uint64_t mask = 0;
-
+    // As in MySharedPtr, only the deepest PATH_SIZE nodes of the path are
+    // kept, in a ring, each with the index of its first leaf. A jump past
+    // them descends again from the root, and a copy is a fixed handful of
+    // words instead of a stack as deep as the largest tree.
+    static const size_t PATH_SIZE = 8;
+
+    NodePtr root;
+    size_t index = 0;
+    std::array<NodePtr, PATH_SIZE> path{};
+    std::array<Size, PATH_SIZE> starts{};
+    uint8_t top = 0;
+    uint8_t depth = 0;
+
+    template <bool>
+    friend class BaseIterator;
     friend struct KFold;
 
-    void go_to_kth(size_t k) {
-      while (stack.back()->size > 1) {
-        auto intermediate_node = static_cast<IntermediateNode*>(stack.back());
-        size_t index = which(k, stack.back()->size);
-        mask |= index << ((stack.size() - 1) * B);
-        k -= child_size(stack.back()->size) * index;
-        stack.push_back(intermediate_node->children[index].get());
-      }
+    void push(NodePtr node, size_t start) {
+      top = (top + 1) % PATH_SIZE;
+      path[top] = node;
+      starts[top] = start;
+      depth += depth < PATH_SIZE;
     }
 
-    BaseIterator(BaseNode* root, size_t index) : stack({root}) {
-      if (index < root->size) {
-        go_to_kth(index);
-      } else {
-        stack.push_back(nullptr);
+    void go_to_index() {
+      Stats::descent();
+      while (!path[top].is_leaf()) {
+        Stats::step();
+        auto intermediate_node =
+            static_cast<IntermediateNode*>(path[top].get());
+        size_t child = which(index - starts[top], intermediate_node->size);
+        push(intermediate_node->children[child].get(),
+             starts[top] + child_size(intermediate_node->size) * child);
       }
     }
 
-    explicit BaseIterator(const StackType& stack) : stack(stack) {}
+    BaseIterator(NodePtr root, size_t index) : root(root), index(index) {
+      if (root && index < root->size) {
+        push(root, 0);
+        go_to_index();
+      }
+    }
 
    public:
     using iterator_category = std::random_access_iterator_tag;
@@ -141,33 +207,30 @@ struct KFold {
     BaseIterator& operator=(const BaseIterator&) = default;
 
     reference operator*() const {
-      return static_cast<DataNode*>(stack.back())->x;
+      return static_cast<DataNode*>(path[top].get())->x;
     }
 
     pointer operator->() const {
-      return &static_cast<DataNode*>(stack.back())->x;
+      return &static_cast<DataNode*>(path[top].get())->x;
     }
 
     reference operator[](difference_type n) const { return *operator+(n); }
 
     BaseIterator& operator+=(difference_type n) {
-      difference_type k = n;
-      if (!stack.back()) {
-        stack.pop_back();
-        k += stack.back()->size;
-      }
-      while (stack.size() > 1 && !(0 <= k && k < stack.back()->size)) {
-        auto parent = static_cast<IntermediateNode*>(stack[stack.size() - 2]);
-        size_t index = mask >> ((stack.size() - 2) * B) & (K - 1);
-        k += child_size(parent->size) * index;
-        stack.pop_back();
-        mask &= ~((K - 1) << ((stack.size() - 1) * B));
+      Stats::jump();
+      index += n;
+      while (depth && index - starts[top] >= path[top]->size) {
+        top = (top + PATH_SIZE - 1) % PATH_SIZE;
+        --depth;
+        Stats::pop();
       }
-      if (0 <= k && k < stack.back()->size) {
-        go_to_kth(k);
-      } else {
-        stack.push_back(nullptr);
+      if (!depth) {
+        if (!root || index >= root->size) {
+          return *this;
+        }
+        push(root, 0);
       }
+      go_to_index();
       return *this;
     }
 
@@ -202,50 +265,69 @@ struct KFold {
     }
 
     difference_type operator-(const BaseIterator& other) const {
-      size_t lca_depth = std::min(stack.size(), other.stack.size()) - 1;
-      while (stack[lca_depth] != other.stack[lca_depth]) {
-        --lca_depth;
-      }
-      auto lca_index = [&](const StackType& stack, uint64_t mask) {
-        if (!stack.back()) {
-          return stack[0]->size;
-        }
-        size_t result = 0;
-        for (size_t i = lca_depth; i + 1 < stack.size(); ++i) {
-          auto intermediate_node = static_cast<IntermediateNode*>(stack[i]);
-          size_t index = mask >> (B * i) & (K - 1);
-          result += child_size(intermediate_node->size) * index;
-        }
-        return result;
-      };
-      return lca_index(stack, mask) - lca_index(other.stack, other.mask);
+      return static_cast<difference_type>(index - other.index);
     }
 
     std::strong_ordering operator<=>(const BaseIterator& other) const {
-      return operator-(other) <=> 0;
+      return index <=> other.index;
     }
 
     bool operator==(const BaseIterator& other) const {
-      return stack.back() == other.stack.back();
+      return index == other.index;
     }
 
     friend BaseIterator operator+(difference_type i, const BaseIterator& iter) {
       return iter + i;
     }
 
-    explicit operator BaseIterator<true>() { return BaseIterator<true>(stack); }
+    explicit operator BaseIterator<true>() {
+      BaseIterator<true> result;
+      result.root = root;
+      result.index = index;
+      result.path = path;
+      result.starts = starts;
+      result.top = top;
+      result.depth = depth;
+      return result;
+    }
+  };
+
+  // A lookup that gather() advances one level at a time. The child chosen by
+  // a step is prefetched right away and only read on the next round.
+  struct Probe {
+    NodePtr node;
+    size_t k;
   };
 
+  Probe probe(size_t i) const {
+    Stats::descent();
+    return {root.get(), i};
+  }
+
+  static bool step(Probe& probe) {
+    if (probe.node.is_leaf()) {
+      return false;
+    }
+    Stats::step();
+    auto intermediate_node = static_cast<IntermediateNode*>(probe.node.get());
+    size_t child = which(probe.k, intermediate_node->size);
+    probe.k -= child_size(intermediate_node->size) * child;
+    probe.node = intermediate_node->children[child].get();
+    prefetch(probe.node.get(), probe.node.is_leaf() ? sizeof(DataNode)
+                                                    : sizeof(IntermediateNode));
+    return true;
+  }
+
+  static const T& value(const Probe& probe) {
+    return static_cast<DataNode*>(probe.node.get())->x;
+  }
+
   explicit KFold(Rc root) : root(std::move(root)) {}
 
   BaseIterator<true> begin() const { return {root.get(), 0}; }
 
   BaseIterator<true> end() const { return {root.get(), size()}; }
 
-  BaseIterator<false> mutable_begin() { return {root.get(), 0}; }
-
-  BaseIterator<false> mutable_end() { return {root.get(), size()}; }
-
   template <std::input_iterator Iter>
   static Rc build_from_iter(size_t l, size_t r, Iter& iter) {
     if (l == r) {
@@ -264,59 +346,211 @@ struct KFold {
     }
   }
 
-  static Rc build_filled(size_t l, size_t r, const T& fill) {
-    if (l == r) {
+  // Filled subtrees of the same size are identical, so every size is built
+  // once and shared.
+  static Rc build_filled(size_t size, const T& fill,
+                         std::unordered_map<size_t, Rc>& built) {
+    if (size == 0) {
       return Rc{};
-    } else if (l + 1 == r) {
-      return Rc::make_base(fill);
-    } else {
-      size_t size = r - l;
-      std::array<Rc, K> children{};
-      for (int i = 0; i < K; ++i) {
-        children[i] =
-            build_filled(std::min(r, l + child_size(size) * i),
-                         std::min(r, l + child_size(size) * (i + 1)), fill);
+    }
+    auto it = built.find(size);
+    if (it == built.end()) {
+      Rc node;
+      if (size == 1) {
+        node = Rc::make_base(fill);
+      } else {
+        std::array<Rc, K> children{};
+        for (int i = 0; i < K; ++i) {
+          children[i] =
+              build_filled(std::min(size, child_size(size) * (i + 1)) -
+                               std::min(size, child_size(size) * i),
+                           fill, built);
+        }
+        node = Rc::make_intermediate(size, std::move(children));
       }
-      return Rc::make_intermediate(size, std::move(children));
+      it = built.emplace(size, std::move(node)).first;
     }
+    return it->second;
   }
 
   template <typename... Args>
-  Rc updated_node(BaseNode* curr, size_t i, Args&&... args) const {
-    if (curr->size == 1) {
+  Rc updated_node(NodePtr curr, size_t i, Args&&... args) const {
+    if (curr.is_leaf()) {
       return Rc::make_base(std::forward<Args>(args)...);
     }
-    auto intermediate_node = static_cast<IntermediateNode*>(curr);
-    std::array<Rc, K> new_children{intermediate_node->children};
+    Stats::step();
+    auto intermediate_node = static_cast<IntermediateNode*>(curr.get());
     size_t index = which(i, curr->size);
     i -= child_size(curr->size) * index;
-    new_children[index] =
-        updated_node(new_children[index].get(), i, std::forward<Args>(args)...);
-    return Rc::make_intermediate(curr->size, std::move(new_children));
+    Rc updated = updated_node(intermediate_node->children[index].get(), i,
+                              std::forward<Args>(args)...);
+    return Rc::make_intermediate(
+        curr->size,
+        Rc::replaced(intermediate_node->children, index, std::move(updated)));
+  }
+
+  // Path copying that reuses nodes nothing else points to: they are changed
+  // in place, and copying starts at the first shared node.
+  template <typename... Args>
+  void update_in_place(Rc& node, size_t i, Args&&... args) {
+    if (node->ref_count != 1) {
+      node = updated_node(node.get(), i, std::forward<Args>(args)...);
+    } else if (node.get().is_leaf()) {
+      static_cast<DataNode*>(node.get().get())->x =
+          T(std::forward<Args>(args)...);
+    } else {
+      Stats::step();
+      auto intermediate_node = static_cast<IntermediateNode*>(node.get().get());
+      size_t child = which(i, node->size);
+      update_in_place(intermediate_node->children[child],
+                      i - child_size(node->size) * child,
+                      std::forward<Args>(args)...);
+    }
+  }
+
+  // Replaces a shared node with a copy that only this version points to. The
+  // copy shares the children, which are copied in turn when written.
+  static void own(Rc& node) {
+    if (node->ref_count == 1) {
+      return;
+    }
+    if (node.get().is_leaf()) {
+      node = Rc::make_base(static_cast<DataNode*>(node.get().get())->x);
+    } else {
+      auto intermediate_node = static_cast<IntermediateNode*>(node.get().get());
+      node = Rc::make_intermediate(node->size, intermediate_node->children);
+    }
+  }
+
+  // Calls fn on the values at positions [l, r) of node, in order.
+  template <typename Fn>
+  static void modify_node(Rc& node, size_t l, size_t r, Fn& fn) {
+    own(node);
+    if (node.get().is_leaf()) {
+      fn(static_cast<DataNode*>(node.get().get())->x);
+      return;
+    }
+    Stats::step();
+    auto intermediate_node = static_cast<IntermediateNode*>(node.get().get());
+    size_t stride = child_size(node->size);
+    for (size_t child = l / stride; child * stride < r; ++child) {
+      size_t begin = child * stride;
+      modify_node(intermediate_node->children[child],
+                  std::max(l, begin) - begin,
+                  std::min(r, begin + stride) - begin, fn);
+    }
+  }
+
+  static bool equal_nodes(NodePtr a, NodePtr b) {
+    if (a == b) {
+      return true;
+    }
+    if (!a || !b || a->size != b->size) {
+      return false;
+    }
+    if (a.is_leaf()) {
+      return static_cast<DataNode*>(a.get())->x ==
+             static_cast<DataNode*>(b.get())->x;
+    }
+    auto a_node = static_cast<IntermediateNode*>(a.get());
+    auto b_node = static_cast<IntermediateNode*>(b.get());
+    for (int i = 0; i < K; ++i) {
+      if (!equal_nodes(a_node->children[i].get(), b_node->children[i].get())) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Copies positions [l, r) of the subtree at node to out.
+  static T* copy_node(NodePtr node, size_t l, size_t r, T* out) {
+    if (node.is_leaf()) {
+      *out = static_cast<DataNode*>(node.get())->x;
+      return out + 1;
+    }
+    auto intermediate_node = static_cast<IntermediateNode*>(node.get());
+    size_t stride = child_size(node->size);
+    for (size_t child = l / stride; child * stride < r; ++child) {
+      size_t begin = child * stride;
+      out = copy_node(intermediate_node->children[child].get(),
+                      std::max(l, begin) - begin,
+                      std::min(r, begin + stride) - begin, out);
+    }
+    return out;
+  }
+
+  // Node accounting for history: the nodes a version holds and what each of
+  // them takes on the heap.
+  const BaseNode* root_node() const { return root.get().get(); }
+
+  template <typename F>
+  static void for_each_child(const BaseNode* node, F f) {
+    if (node->size == 1) {
+      return;
+    }
+    for (auto& child : static_cast<const IntermediateNode*>(node)->children) {
+      if (auto ptr = child.get()) {
+        f(ptr.get());
+      }
+    }
+  }
+
+  static size_t node_bytes(const BaseNode* node) {
+    return node->size == 1 ? sizeof(DataNode) : sizeof(IntermediateNode);
   }
 
   static KFold filled(size_t count, const T& fill) {
-    return KFold{std::move(build_filled(0, count, fill))};
+    std::unordered_map<size_t, Rc> built;
+    return KFold{build_filled(count, fill, built)};
   }
 
-  template <std::forward_iterator Iter>
+  template <SizedIterator Iter>
   static KFold from_iter(Iter first, Iter last) {
-    return KFold{
-        std::move(build_from_iter(0, std::distance(first, last), first))};
+    size_t count = std::ranges::distance(first, last);
+    return KFold{build_from_iter(0, count, first)};
   }
 
   template <typename... Args>
-  KFold update(size_t index, Args&&... args) const {
+  KFold update(size_t index, Args&&... args) const& {
+    Stats::descent();
     auto new_root =
         updated_node(root.get(), index, std::forward<Args>(args)...);
     return KFold{std::move(new_root)};
   }
+
+  template <typename... Args>
+  KFold update(size_t index, Args&&... args) && {
+    Stats::descent();
+    update_in_place(root, index, std::forward<Args>(args)...);
+    return std::move(*this);
+  }
+
+  // Writes through fn into the nodes of [first, last), copying those other
+  // versions share first.
+  template <typename Fn>
+  KFold modify_range(size_t first, size_t last, Fn& fn) && {
+    if (first != last) {
+      Stats::descent();
+      modify_node(root, first, last, fn);
+    }
+    return std::move(*this);
+  }
+
+  T* copy_to(size_t first, size_t last, T* out) const {
+    return first == last ? out : copy_node(root.get(), first, last, out);
+  }
+
+  bool operator==(const KFold& other) const {
+    return equal_nodes(root.get(), other.root.get());
+  }
 };
 
-template <typename T>
-using FourFold = KFold<T, 2>;
+template <typename T, typename Size = uint32_t,
+          typename Stats = stats::None>
+using FourFold = KFold<T, 2, Size, Stats>;
 
-template <typename T>
-using EightFold = KFold<T, 3>;
+template <typename T, typename Size = uint32_t,
+          typename Stats = stats::None>
+using EightFold = KFold<T, 3, Size, Stats>;
 
 }  // namespace base
\ No newline at end of file
@@ -1,28 +1,71 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
 #include <numeric>
+#include <type_traits>
+#include <unordered_map>
 
-#include "../inplace_vector"
+#include "concepts.h"
+#include "prefetch.h"
+#include "recycle.h"
+#include "stats.h"
 
 namespace base {
 
-template <typename T>
+template <typename T, typename Size = uint32_t,
+          typename Stats = stats::None>
 struct MySharedPtr {
   struct BaseNode {
-    size_t size;
-    size_t ref_count = 1;
+    Size size;
+    uint32_t ref_count = 1;
+    [[no_unique_address]] typename Stats::Node tracker{};
+  };
+
+  // Node pointer with the low bit set for DataNode, so the descent can tell a
+  // leaf from an intermediate node without loading it.
+  class NodePtr {
+    uintptr_t bits = 0;
+
+   public:
+    NodePtr() = default;
+
+    NodePtr(BaseNode* node, bool is_leaf)
+        : bits(reinterpret_cast<uintptr_t>(node) | is_leaf) {}
+
+    BaseNode* get() const {
+      return reinterpret_cast<BaseNode*>(bits & ~uintptr_t{1});
+    }
+
+    BaseNode* operator->() const { return get(); }
+
+    bool is_leaf() const { return bits & 1; }
+
+    explicit operator bool() const { return bits; }
+
+    bool operator==(const NodePtr&) const = default;
   };
 
   class Rc;
 
-  struct IntermediateNode : BaseNode {
+  // Intermediate nodes keep a copy of their last value when it is small, so a
+  // search of a sorted version descends once; otherwise Key takes no space.
+  static constexpr bool KEYED =
+      std::is_trivially_copyable_v<T> && sizeof(T) <= sizeof(void*);
+  struct NoKey {};
+  using Key = std::conditional_t<KEYED, T, NoKey>;
+
+  struct IntermediateNode : BaseNode, Recycled<IntermediateNode> {
     Rc left, right;
+    [[no_unique_address]] Key last;
 
     IntermediateNode(Rc left, Rc right)
         : BaseNode(left->size + right->size),
           left(std::move(left)),
-          right(std::move(right)) {}
+          right(std::move(right)),
+          last(last_of(this->right.get())) {}
   };
 
-  struct DataNode : BaseNode {
+  struct DataNode : BaseNode, Recycled<DataNode> {
     T x;
 
     template <typename... Args>
@@ -31,9 +74,9 @@ struct MySharedPtr {
 
   class Rc {
    private:
-    BaseNode* ptr = nullptr;
+    NodePtr ptr;
 
-    Rc(BaseNode* raw) : ptr(raw) {}
+    Rc(NodePtr raw) : ptr(raw) {}
 
    public:
     Rc(const Rc& rc) : ptr(rc.ptr) {
@@ -43,7 +86,7 @@ struct MySharedPtr {
       ptr->ref_count += 1;
     }
 
-    Rc(Rc&& rc) noexcept : ptr(rc.ptr) { rc.ptr = nullptr; }
+    Rc(Rc&& rc) noexcept : ptr(rc.ptr) { rc.ptr = {}; }
 
     void swap(Rc& rc) { std::swap(ptr, rc.ptr); }
 
@@ -63,67 +106,112 @@ struct MySharedPtr {
       }
       ptr->ref_count -= 1;
       if (ptr->ref_count == 0) {
-        if (ptr->size == 1) {
-          delete static_cast<DataNode*>(ptr);
+        if (ptr.is_leaf()) {
+          delete static_cast<DataNode*>(ptr.get());
         } else {
-          delete static_cast<IntermediateNode*>(ptr);
+          delete static_cast<IntermediateNode*>(ptr.get());
         }
       }
     }
 
-    BaseNode* operator->() const { return ptr; }
+    BaseNode* operator->() const { return ptr.get(); }
 
-    BaseNode& operator*() const { return *ptr; }
+    BaseNode& operator*() const { return *ptr.get(); }
 
-    BaseNode* get() const { return ptr; }
+    NodePtr get() const { return ptr; }
 
     template <typename... Args>
     static Rc make_base(Args&&... args) {
-      return {new DataNode(std::forward<Args>(args)...)};
+      return {{new DataNode(std::forward<Args>(args)...), true}};
     }
 
     static Rc make_intermediate(Rc left, Rc right) {
-      return {new IntermediateNode(std::move(left), std::move(right))};
+      return {{new IntermediateNode(std::move(left), std::move(right)), false}};
     }
+
+    Rc() = default;
   };
 
+  static Key last_of(NodePtr node) {
+    if constexpr (KEYED) {
+      if (node.is_leaf()) {
+        return static_cast<const DataNode*>(node.get())->x;
+      }
+      return static_cast<const IntermediateNode*>(node.get())->last;
+    } else {
+      return {};
+    }
+  }
+
   Rc root;
 
-  size_t size() const { return root->size; }
+  size_t size() const { return root.get() ? root->size : 0; }
 
-  static constexpr size_t MAX_SIZE = UINT32_MAX;
+  static constexpr size_t MAX_SIZE = std::numeric_limits<Size>::max();
 
-  template <bool IsConst>
-  class BaseIterator {
-    static const size_t STACK_SIZE = std::bit_width(MAX_SIZE) + 1;
-    using StackType = std::inplace_vector<BaseNode*, STACK_SIZE>;
+  // Insertions and erasures keep the tree weight-balanced: the lighter child
+  // of every node holds at least ALPHA_PERCENT percent of its leaves, so each
+  // level down keeps at most 71% of them. join() is the weight-balanced join
+  // of Blelloch, Ferizovic and Sun, "Just Join for Parallel Ordered Sets",
+  // which holds the invariant for ALPHA up to 1 - 1/sqrt(2). Trees built by
+  // halving, as from_iter and filled do, are balanced already.
+  static constexpr size_t ALPHA_PERCENT = 29;
 
-    StackType stack;
+  static bool balanced(size_t a, size_t b) {
+    return 100 * std::min(a, b) >= ALPHA_PERCENT * (a + b);
+  }
 
+  template <bool IsConst>
+  class BaseIterator {
+    // A jump climbs only as far as the common ancestor of the old and new
+    // positions, which is rarely more than a few levels up, so only the
+    // deepest PATH_SIZE nodes of the path are kept, in a ring. A jump past
+    // them descends again from the root. Each node is stored with the index
+    // of its first leaf, so a copy is a fixed handful of words.
+    static const size_t PATH_SIZE = 8;
+
+    NodePtr root;
+    size_t index = 0;
+    std::array<NodePtr, PATH_SIZE> path{};
+    std::array<Size, PATH_SIZE> starts{};
+    uint8_t top = 0;
+    uint8_t depth = 0;
+
+    template <bool>
+    friend class BaseIterator;
     friend struct MySharedPtr;
 
-    void go_to_kth(size_t k) {
-      while (stack.back()->size > 1) {
-        auto intermediate_node = static_cast<IntermediateNode*>(stack.back());
-        if (intermediate_node->left->size > k) {
-          stack.push_back(intermediate_node->left.get());
+    void push(NodePtr node, size_t start) {
+      top = (top + 1) % PATH_SIZE;
+      path[top] = node;
+      starts[top] = start;
+      depth += depth < PATH_SIZE;
+    }
+
+    void go_to_index() {
+      Stats::descent();
+      while (!path[top].is_leaf()) {
+        Stats::step();
+        auto intermediate_node =
+            static_cast<IntermediateNode*>(path[top].get());
+        // Fetched while the left child is loaded to pick a side.
+        prefetch(intermediate_node->right.get().get());
+        size_t start = starts[top] + intermediate_node->left->size;
+        if (index < start) {
+          push(intermediate_node->left.get(), starts[top]);
         } else {
-          k -= intermediate_node->left->size;
-          stack.push_back(intermediate_node->right.get());
+          push(intermediate_node->right.get(), start);
         }
       }
     }
 
-    BaseIterator(BaseNode* root, size_t index) : stack({root}) {
-      if (index < root->size) {
-        go_to_kth(index);
-      } else {
-        stack.push_back(nullptr);
+    BaseIterator(NodePtr root, size_t index) : root(root), index(index) {
+      if (root && index < root->size) {
+        push(root, 0);
+        go_to_index();
       }
     }
 
-    explicit BaseIterator(const StackType& stack) : stack(stack) {}
-
    public:
     using iterator_category = std::random_access_iterator_tag;
     using difference_type = std::ptrdiff_t;
@@ -136,33 +224,30 @@ struct MySharedPtr {
     BaseIterator& operator=(const BaseIterator&) = default;
 
     reference operator*() const {
-      return static_cast<DataNode*>(stack.back())->x;
+      return static_cast<DataNode*>(path[top].get())->x;
     }
 
     pointer operator->() const {
-      return &static_cast<DataNode*>(stack.back())->x;
+      return &static_cast<DataNode*>(path[top].get())->x;
     }
 
     reference operator[](difference_type n) const { return *operator+(n); }
 
     BaseIterator& operator+=(difference_type n) {
-      difference_type k = n;
-      if (!stack.back()) {
-        stack.pop_back();
-        k += stack.back()->size;
+      Stats::jump();
+      index += n;
+      while (depth && index - starts[top] >= path[top]->size) {
+        top = (top + PATH_SIZE - 1) % PATH_SIZE;
+        --depth;
+        Stats::pop();
       }
-      while (stack.size() > 1 && !(0 <= k && k < stack.back()->size)) {
-        auto parent = static_cast<IntermediateNode*>(stack[stack.size() - 2]);
-        if (stack.back() == parent->right.get()) {
-          k += parent->left->size;
+      if (!depth) {
+        if (!root || index >= root->size) {
+          return *this;
         }
-        stack.pop_back();
-      }
-      if (0 <= k && k < stack.back()->size) {
-        go_to_kth(k);
-      } else {
-        stack.push_back(nullptr);
+        push(root, 0);
       }
+      go_to_index();
       return *this;
     }
 
@@ -197,54 +282,88 @@ struct MySharedPtr {
     }
 
     difference_type operator-(const BaseIterator& other) const {
-      size_t lca_depth = std::min(stack.size(), other.stack.size()) - 1;
-      while (stack[lca_depth] != other.stack[lca_depth]) {
-        --lca_depth;
-      }
-      auto lca_index = [&](const StackType& stack) {
-        if (!stack.back()) {
-          return stack[0]->size;
-        }
-        size_t result = 0;
-        for (size_t i = lca_depth; i + 1 < stack.size(); ++i) {
-          auto intermediate_node = static_cast<IntermediateNode*>(stack[i]);
-          if (intermediate_node->right.get() == stack[i + 1]) {
-            result += intermediate_node->left->size;
-          }
-        }
-        return result;
-      };
-      return lca_index(stack) - lca_index(other.stack);
+      return static_cast<difference_type>(index - other.index);
     }
 
     std::strong_ordering operator<=>(const BaseIterator& other) const {
-      return operator-(other) <=> 0;
+      return index <=> other.index;
     }
 
     bool operator==(const BaseIterator& other) const {
-      return stack.back() == other.stack.back();
+      return index == other.index;
     }
 
     friend BaseIterator operator+(difference_type i, const BaseIterator& iter) {
       return iter + i;
     }
 
-    explicit operator BaseIterator<true>() { return BaseIterator<true>(stack); }
+    explicit operator BaseIterator<true>() {
+      BaseIterator<true> result;
+      result.root = root;
+      result.index = index;
+      result.path = path;
+      result.starts = starts;
+      result.top = top;
+      result.depth = depth;
+      return result;
+    }
+  };
+
+  // A lookup that gather() advances one level at a time. The children of the
+  // current node are always prefetched, so a step only waits on memory that
+  // was requested a whole round of the group earlier.
+  struct Probe {
+    NodePtr node;
+    size_t k;
   };
 
+  static void prefetch_children(NodePtr node) {
+    auto intermediate_node = static_cast<IntermediateNode*>(node.get());
+    prefetch(intermediate_node->left.get().get());
+    prefetch(intermediate_node->right.get().get());
+  }
+
+  Probe probe(size_t i) const {
+    Stats::descent();
+    if (!root.get().is_leaf()) {
+      prefetch_children(root.get());
+    }
+    return {root.get(), i};
+  }
+
+  static bool step(Probe& probe) {
+    if (probe.node.is_leaf()) {
+      return false;
+    }
+    Stats::step();
+    auto intermediate_node = static_cast<IntermediateNode*>(probe.node.get());
+    if (probe.k < intermediate_node->left->size) {
+      probe.node = intermediate_node->left.get();
+    } else {
+      probe.k -= intermediate_node->left->size;
+      probe.node = intermediate_node->right.get();
+    }
+    if (!(probe.node.is_leaf())) {
+      prefetch_children(probe.node);
+    }
+    return true;
+  }
+
+  static const T& value(const Probe& probe) {
+    return static_cast<DataNode*>(probe.node.get())->x;
+  }
+
   explicit MySharedPtr(Rc root) : root(std::move(root)) {}
 
   BaseIterator<true> begin() const { return {root.get(), 0}; }
 
   BaseIterator<true> end() const { return {root.get(), size()}; }
 
-  BaseIterator<false> mutable_begin() { return {root.get(), 0}; }
-
-  BaseIterator<false> mutable_end() { return {root.get(), size()}; }
-
   template <std::input_iterator Iter>
   static Rc build_from_iter(size_t l, size_t r, Iter& iter) {
-    if (l + 1 == r) {
+    if (l == r) {
+      return Rc{};
+    } else if (l + 1 == r) {
       return Rc::make_base(*iter++);
     } else {
       size_t m = std::midpoint(l, r);
@@ -254,23 +373,31 @@ struct MySharedPtr {
     }
   }
 
-  static Rc build_filled(size_t l, size_t r, const T& fill) {
-    if (l + 1 == r) {
-      return Rc::make_base(fill);
-    } else {
-      size_t m = std::midpoint(l, r);
-      auto left = build_filled(l, m, fill);
-      auto right = build_filled(m, r, fill);
-      return Rc::make_intermediate(std::move(left), std::move(right));
+  // Filled subtrees of the same size are identical, so every size is built
+  // once and shared.
+  static Rc build_filled(size_t size, const T& fill,
+                         std::unordered_map<size_t, Rc>& built) {
+    if (size == 0) {
+      return Rc{};
     }
+    auto it = built.find(size);
+    if (it == built.end()) {
+      auto node = size == 1 ? Rc::make_base(fill)
+                            : Rc::make_intermediate(
+                                  build_filled(size / 2, fill, built),
+                                  build_filled(size - size / 2, fill, built));
+      it = built.emplace(size, std::move(node)).first;
+    }
+    return it->second;
   }
 
   template <typename... Args>
-  Rc updated_node(BaseNode* curr, size_t i, Args&&... args) const {
-    if (curr->size == 1) {
+  Rc updated_node(NodePtr curr, size_t i, Args&&... args) const {
+    if (curr.is_leaf()) {
       return Rc::make_base(std::forward<Args>(args)...);
     }
-    auto intermediate_node = static_cast<IntermediateNode*>(curr);
+    Stats::step();
+    auto intermediate_node = static_cast<IntermediateNode*>(curr.get());
     if (i < intermediate_node->left->size) {
       auto new_left = updated_node(intermediate_node->left.get(), i,
                                    std::forward<Args>(args)...);
@@ -285,22 +412,279 @@ struct MySharedPtr {
     }
   }
 
+  // Path copying that reuses nodes nothing else points to: they are changed
+  // in place, and copying starts at the first shared node.
+  template <typename... Args>
+  void update_in_place(Rc& node, size_t i, Args&&... args) {
+    if (node->ref_count != 1) {
+      node = updated_node(node.get(), i, std::forward<Args>(args)...);
+    } else if (node.get().is_leaf()) {
+      static_cast<DataNode*>(node.get().get())->x =
+          T(std::forward<Args>(args)...);
+    } else {
+      Stats::step();
+      auto intermediate_node = static_cast<IntermediateNode*>(node.get().get());
+      if (i < intermediate_node->left->size) {
+        update_in_place(intermediate_node->left, i,
+                        std::forward<Args>(args)...);
+      } else {
+        update_in_place(intermediate_node->right,
+                        i - intermediate_node->left->size,
+                        std::forward<Args>(args)...);
+        intermediate_node->last = last_of(intermediate_node->right.get());
+      }
+    }
+  }
+
+  // Replaces a shared node with a copy that only this version points to. The
+  // copy shares the children, which are copied in turn when written.
+  static void own(Rc& node) {
+    if (node->ref_count == 1) {
+      return;
+    }
+    if (node.get().is_leaf()) {
+      node = Rc::make_base(static_cast<DataNode*>(node.get().get())->x);
+    } else {
+      auto intermediate_node = static_cast<IntermediateNode*>(node.get().get());
+      node = Rc::make_intermediate(intermediate_node->left,
+                                   intermediate_node->right);
+    }
+  }
+
+  // Calls fn on the values at positions [l, r) of node, in order.
+  template <typename Fn>
+  static void modify_node(Rc& node, size_t l, size_t r, Fn& fn) {
+    own(node);
+    if (node.get().is_leaf()) {
+      fn(static_cast<DataNode*>(node.get().get())->x);
+      return;
+    }
+    Stats::step();
+    auto intermediate_node = static_cast<IntermediateNode*>(node.get().get());
+    size_t middle = intermediate_node->left->size;
+    if (l < middle) {
+      modify_node(intermediate_node->left, l, std::min(r, middle), fn);
+    }
+    if (middle < r) {
+      modify_node(intermediate_node->right, std::max(l, middle) - middle,
+                  r - middle, fn);
+      intermediate_node->last = last_of(intermediate_node->right.get());
+    }
+  }
+
+  // Concatenates two balanced trees, either of which may be empty.
+  static Rc join(Rc left, Rc right) {
+    if (!left.get()) {
+      return right;
+    }
+    if (!right.get()) {
+      return left;
+    }
+    if (balanced(left->size, right->size)) {
+      return Rc::make_intermediate(std::move(left), std::move(right));
+    }
+    if (left->size > right->size) {
+      auto heavy = static_cast<IntermediateNode*>(left.get().get());
+      return rotated_left(heavy->left, join(heavy->right, std::move(right)));
+    }
+    auto heavy = static_cast<IntermediateNode*>(right.get().get());
+    return rotated_right(join(std::move(left), heavy->left), heavy->right);
+  }
+
+  // A node over left and right, where right may have grown too heavy for
+  // left; restored by a single or a double rotation.
+  static Rc rotated_left(Rc left, Rc right) {
+    if (balanced(left->size, right->size)) {
+      return Rc::make_intermediate(std::move(left), std::move(right));
+    }
+    auto heavy = static_cast<IntermediateNode*>(right.get().get());
+    size_t inner_size = heavy->left->size;
+    if (balanced(left->size, inner_size) &&
+        balanced(left->size + inner_size, heavy->right->size)) {
+      return Rc::make_intermediate(
+          Rc::make_intermediate(std::move(left), heavy->left), heavy->right);
+    }
+    auto inner = static_cast<IntermediateNode*>(heavy->left.get().get());
+    return Rc::make_intermediate(
+        Rc::make_intermediate(std::move(left), inner->left),
+        Rc::make_intermediate(inner->right, heavy->right));
+  }
+
+  static Rc rotated_right(Rc left, Rc right) {
+    if (balanced(left->size, right->size)) {
+      return Rc::make_intermediate(std::move(left), std::move(right));
+    }
+    auto heavy = static_cast<IntermediateNode*>(left.get().get());
+    size_t inner_size = heavy->right->size;
+    if (balanced(inner_size, right->size) &&
+        balanced(heavy->left->size, inner_size + right->size)) {
+      return Rc::make_intermediate(
+          heavy->left, Rc::make_intermediate(heavy->right, std::move(right)));
+    }
+    auto inner = static_cast<IntermediateNode*>(heavy->right.get().get());
+    return Rc::make_intermediate(
+        Rc::make_intermediate(heavy->left, inner->left),
+        Rc::make_intermediate(inner->right, std::move(right)));
+  }
+
+  // The first k leaves of node and the rest, as balanced trees.
+  static std::pair<Rc, Rc> split(const Rc& node, size_t k) {
+    if (k == 0) {
+      return {Rc{}, node};
+    }
+    if (k == node->size) {
+      return {node, Rc{}};
+    }
+    auto intermediate_node = static_cast<IntermediateNode*>(node.get().get());
+    size_t middle = intermediate_node->left->size;
+    if (k < middle) {
+      auto [left, right] = split(intermediate_node->left, k);
+      return {std::move(left),
+              join(std::move(right), intermediate_node->right)};
+    }
+    auto [left, right] = split(intermediate_node->right, k - middle);
+    return {join(intermediate_node->left, std::move(left)), std::move(right)};
+  }
+
+  static bool equal_nodes(NodePtr a, NodePtr b) {
+    if (a == b) {
+      return true;
+    }
+    if (!a || !b || a->size != b->size) {
+      return false;
+    }
+    if (a.is_leaf()) {
+      return static_cast<DataNode*>(a.get())->x ==
+             static_cast<DataNode*>(b.get())->x;
+    }
+    auto a_node = static_cast<IntermediateNode*>(a.get());
+    auto b_node = static_cast<IntermediateNode*>(b.get());
+    // Insertions and erasures can give equal contents different shapes.
+    if (a_node->left->size != b_node->left->size) {
+      BaseIterator<true> a_begin(a, 0), a_end(a, a->size), b_begin(b, 0);
+      return std::equal(a_begin, a_end, b_begin);
+    }
+    return equal_nodes(a_node->left.get(), b_node->left.get()) &&
+           equal_nodes(a_node->right.get(), b_node->right.get());
+  }
+
+  // Copies positions [l, r) of the subtree at node to out.
+  static T* copy_node(NodePtr node, size_t l, size_t r, T* out) {
+    if (node.is_leaf()) {
+      *out = static_cast<DataNode*>(node.get())->x;
+      return out + 1;
+    }
+    auto intermediate_node = static_cast<IntermediateNode*>(node.get());
+    size_t middle = intermediate_node->left->size;
+    if (l < middle) {
+      out = copy_node(intermediate_node->left.get(), l, std::min(r, middle),
+                      out);
+    }
+    if (middle < r) {
+      out = copy_node(intermediate_node->right.get(),
+                      std::max(l, middle) - middle, r - middle, out);
+    }
+    return out;
+  }
+
+  // Node accounting for history: the nodes a version holds and what each of
+  // them takes on the heap.
+  const BaseNode* root_node() const { return root.get().get(); }
+
+  template <typename F>
+  static void for_each_child(const BaseNode* node, F f) {
+    if (node->size == 1) {
+      return;
+    }
+    auto intermediate_node = static_cast<const IntermediateNode*>(node);
+    f(intermediate_node->left.get().get());
+    f(intermediate_node->right.get().get());
+  }
+
+  static size_t node_bytes(const BaseNode* node) {
+    return node->size == 1 ? sizeof(DataNode) : sizeof(IntermediateNode);
+  }
+
   static MySharedPtr filled(size_t count, const T& fill) {
-    return MySharedPtr{std::move(build_filled(0, count, fill))};
+    std::unordered_map<size_t, Rc> built;
+    return MySharedPtr{build_filled(count, fill, built)};
   }
 
-  template <std::forward_iterator Iter>
+  template <SizedIterator Iter>
   static MySharedPtr from_iter(Iter first, Iter last) {
-    return MySharedPtr{
-        std::move(build_from_iter(0, std::distance(first, last), first))};
+    size_t count = std::ranges::distance(first, last);
+    return MySharedPtr{build_from_iter(0, count, first)};
   }
 
   template <typename... Args>
-  MySharedPtr update(size_t index, Args&&... args) const {
+  MySharedPtr update(size_t index, Args&&... args) const& {
+    Stats::descent();
     auto new_root =
         updated_node(root.get(), index, std::forward<Args>(args)...);
     return MySharedPtr{std::move(new_root)};
   }
+
+  template <typename... Args>
+  MySharedPtr update(size_t index, Args&&... args) && {
+    Stats::descent();
+    update_in_place(root, index, std::forward<Args>(args)...);
+    return std::move(*this);
+  }
+
+  // Writes through fn into the nodes of [first, last), copying those other
+  // versions share first.
+  template <typename Fn>
+  MySharedPtr modify_range(size_t first, size_t last, Fn& fn) && {
+    if (first != last) {
+      Stats::descent();
+      modify_node(root, first, last, fn);
+    }
+    return std::move(*this);
+  }
+
+  // Replaces positions [first, last) with the contents of inserted in
+  // O(log n) time.
+  MySharedPtr splice(size_t first, size_t last,
+                     const MySharedPtr& inserted) const {
+    auto [left, rest] = split(root, first);
+    auto right = split(rest, last - first).second;
+    return MySharedPtr{
+        join(join(std::move(left), inserted.root), std::move(right))};
+  }
+
+  T* copy_to(size_t first, size_t last, T* out) const {
+    return first == last ? out : copy_node(root.get(), first, last, out);
+  }
+
+  // The number of leading values that satisfy pred, which must hold for a
+  // prefix of the array: one descent, testing the last value of each left
+  // subtree.
+  template <typename Pred>
+    requires KEYED
+  size_t partition_point(Pred pred) const {
+    if (!root.get()) {
+      return 0;
+    }
+    Stats::descent();
+    size_t index = 0;
+    NodePtr node = root.get();
+    while (!node.is_leaf()) {
+      Stats::step();
+      auto intermediate_node = static_cast<IntermediateNode*>(node.get());
+      NodePtr left = intermediate_node->left.get();
+      if (pred(last_of(left))) {
+        index += left->size;
+        node = intermediate_node->right.get();
+      } else {
+        node = left;
+      }
+    }
+    return index + pred(static_cast<const DataNode*>(node.get())->x);
+  }
+
+  bool operator==(const MySharedPtr& other) const {
+    return equal_nodes(root.get(), other.root.get());
+  }
 };
 
 }  // namespace base
\ No newline at end of file
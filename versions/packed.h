@@ -0,0 +1,582 @@
+#include <array>
+#include <bit>
+#include <concepts>
+#include <cstring>
+#include <numeric>
+#include <unordered_map>
+#include <utility>
+
+#include "concepts.h"
+#include "prefetch.h"
+#include "recycle.h"
+#include "stats.h"
+
+namespace base {
+
+// K-ary tree over blocks of up to LEAF_SIZE integers. Each block is stored
+// frame-of-reference encoded: the block minimum plus every value's offset from
+// it, bit-packed with just enough bits for the largest offset.
+template <typename T, typename Size = uint32_t,
+          typename Stats = stats::None>
+  requires std::integral<T> && (!std::same_as<T, bool>)
+struct Packed {
+  static const int B = 3;
+  static const int K = 1 << B;
+  static const size_t LEAF_SIZE = 64;
+
+  using Word = uint64_t;
+  using Unsigned = std::make_unsigned_t<T>;
+
+  static const size_t WORD_BITS = std::numeric_limits<Word>::digits;
+
+  struct BaseNode {
+    Size size;
+    uint32_t ref_count = 1;
+    [[no_unique_address]] typename Stats::Node tracker{};
+  };
+
+  class Rc;
+
+  struct IntermediateNode : BaseNode, Recycled<IntermediateNode> {
+    std::array<Rc, K> children;
+
+    IntermediateNode(size_t size, std::array<Rc, K> c)
+        : BaseNode(size), children(std::move(c)) {}
+  };
+
+  // The packed words are allocated right after the node itself.
+  struct LeafNode : BaseNode {
+    T reference;
+    unsigned width;
+
+    LeafNode(size_t size, T reference, unsigned width)
+        : BaseNode(size), reference(reference), width(width) {}
+
+    // Every value is read from the word it starts in and the one after it,
+    // and the words end with enough zero padding for that to hold for the
+    // last value too, so reads need no branch for values straddling words.
+    static size_t word_count(size_t size, unsigned width) {
+      return size * width / WORD_BITS + 2;
+    }
+
+    Word* words() { return reinterpret_cast<Word*>(this + 1); }
+
+    const Word* words() const {
+      return reinterpret_cast<const Word*>(this + 1);
+    }
+
+    Word mask() const {
+      return width == WORD_BITS ? ~Word{0} : (Word{1} << width) - 1;
+    }
+
+    // The value whose bits start at bit. Shifting by WORD_BITS is undefined,
+    // so the next word moves up in two steps, which push it out entirely
+    // when shift is 0.
+    T at_bit(size_t bit, Word mask) const {
+      const Word* word = words() + bit / WORD_BITS;
+      size_t shift = bit % WORD_BITS;
+      Word offset =
+          word[0] >> shift | word[1] << 1 << (WORD_BITS - 1 - shift);
+      return static_cast<T>(static_cast<Unsigned>(
+          static_cast<Unsigned>(reference) +
+          static_cast<Unsigned>(offset & mask)));
+    }
+
+    T get(size_t i) const { return at_bit(i * width, mask()); }
+
+    void decode(T* out) const { decode(0, this->size, out); }
+
+    // Unpacks [first, last) with the width and mask hoisted out of a loop
+    // that has no branches.
+    void decode(size_t first, size_t last, T* out) const {
+      if (width == 0) {
+        std::fill(out, out + (last - first), reference);
+        return;
+      }
+      Word mask = this->mask();
+      size_t bit = first * width;
+      for (size_t i = first; i < last; ++i, bit += width) {
+        *out++ = at_bit(bit, mask);
+      }
+    }
+
+    bool operator==(const LeafNode& other) const {
+      return this->size == other.size && reference == other.reference &&
+             width == other.width &&
+             std::memcmp(words(), other.words(),
+                         word_count(this->size, width) * sizeof(Word)) == 0;
+    }
+  };
+
+  class Rc {
+   private:
+    BaseNode* ptr = nullptr;
+
+    Rc(BaseNode* raw) : ptr(raw) {}
+
+   public:
+    Rc(const Rc& rc) : ptr(rc.ptr) {
+      if (!ptr) {
+        return;
+      }
+      ptr->ref_count += 1;
+    }
+
+    Rc(Rc&& rc) noexcept : ptr(rc.ptr) { rc.ptr = nullptr; }
+
+    void swap(Rc& rc) { std::swap(ptr, rc.ptr); }
+
+    Rc& operator=(const Rc& rc) {
+      Rc{rc}.swap(*this);
+      return *this;
+    }
+
+    Rc& operator=(Rc&& rc) noexcept {
+      Rc{std::move(rc)}.swap(*this);
+      return *this;
+    }
+
+    ~Rc() {
+      if (!ptr) {
+        return;
+      }
+      ptr->ref_count -= 1;
+      if (ptr->ref_count == 0) {
+        if (is_leaf(ptr)) {
+          auto leaf = static_cast<LeafNode*>(ptr);
+          leaf->~LeafNode();
+          ::operator delete(leaf);
+        } else {
+          delete static_cast<IntermediateNode*>(ptr);
+        }
+      }
+    }
+
+    BaseNode* operator->() const { return ptr; }
+
+    BaseNode& operator*() const { return *ptr; }
+
+    BaseNode* get() const { return ptr; }
+
+    static Rc make_leaf(const T* values, size_t size) {
+      auto [min, max] = std::minmax_element(values, values + size);
+      T reference = *min;
+      unsigned width = std::bit_width(static_cast<Unsigned>(
+          static_cast<Unsigned>(*max) - static_cast<Unsigned>(reference)));
+      size_t words = LeafNode::word_count(size, width);
+      void* memory = ::operator new(sizeof(LeafNode) + words * sizeof(Word));
+      auto leaf = new (memory) LeafNode(size, reference, width);
+      std::fill_n(leaf->words(), words, Word{0});
+      for (size_t i = 0; i < size && width > 0; ++i) {
+        Word offset = static_cast<Unsigned>(static_cast<Unsigned>(values[i]) -
+                                            static_cast<Unsigned>(reference));
+        size_t bit = i * width;
+        size_t shift = bit % WORD_BITS;
+        leaf->words()[bit / WORD_BITS] |= offset << shift;
+        if (shift + width > WORD_BITS) {
+          leaf->words()[bit / WORD_BITS + 1] |= offset >> (WORD_BITS - shift);
+        }
+      }
+      return {leaf};
+    }
+
+    // children with the one at index swapped for child. The pointers are
+    // copied as a block and only the children kept gain a reference, instead
+    // of copying each Rc and then releasing the replaced one.
+    static std::array<Rc, K> replaced(const std::array<Rc, K>& children,
+                                      size_t index, Rc child) {
+      std::array<Rc, K> result;
+      for (size_t j = 0; j < K; ++j) {
+        result[j].ptr = children[j].ptr;
+      }
+      for (size_t j = 0; j < K; ++j) {
+        if (j != index && result[j].ptr) {
+          result[j].ptr->ref_count += 1;
+        }
+      }
+      result[index].ptr = std::exchange(child.ptr, {});
+      return result;
+    }
+
+    static Rc make_intermediate(size_t size, std::array<Rc, K> c) {
+      return {new IntermediateNode(size, std::move(c))};
+    }
+
+    Rc() = default;
+  };
+
+  Rc root;
+
+  size_t size() const { return root.get() ? root->size : 0; }
+
+  static constexpr size_t MAX_SIZE = std::numeric_limits<Size>::max();
+
+  static bool is_leaf(const BaseNode* node) { return node->size <= LEAF_SIZE; }
+
+  // Children cover whole blocks, so only the last block of a node is partial.
+  static size_t child_size(size_t n) {
+    const size_t span = LEAF_SIZE * K;
+    return (n / span + (n % span != 0)) * LEAF_SIZE;
+  }
+
+  static size_t which(size_t i, size_t n) { return i / child_size(n); }
+
+  template <bool IsConst>
+  class BaseIterator {
+    // As in MySharedPtr, only the deepest PATH_SIZE nodes of the path are
+    // kept, in a ring, each with the index of its first value. A jump past
+    // them descends again from the root.
+    static const size_t PATH_SIZE = 8;
+
+    BaseNode* root = nullptr;
+    size_t index = 0;
+    std::array<BaseNode*, PATH_SIZE> path{};
+    std::array<Size, PATH_SIZE> starts{};
+    uint8_t top = 0;
+    uint8_t depth = 0;
+
+    friend struct Packed;
+
+    void push(BaseNode* node, size_t start) {
+      top = (top + 1) % PATH_SIZE;
+      path[top] = node;
+      starts[top] = start;
+      depth += depth < PATH_SIZE;
+    }
+
+    void go_to_index() {
+      Stats::descent();
+      while (!is_leaf(path[top])) {
+        Stats::step();
+        auto intermediate_node = static_cast<IntermediateNode*>(path[top]);
+        size_t child = which(index - starts[top], intermediate_node->size);
+        push(intermediate_node->children[child].get(),
+             starts[top] + child_size(intermediate_node->size) * child);
+      }
+    }
+
+    BaseIterator(BaseNode* root, size_t index) : root(root), index(index) {
+      if (root && index < root->size) {
+        push(root, 0);
+        go_to_index();
+      }
+    }
+
+   public:
+    // Values are decoded on access, so dereferencing yields a prvalue.
+    using iterator_concept = std::random_access_iterator_tag;
+    using iterator_category = std::input_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = T;
+    using reference = T;
+
+    BaseIterator() = default;
+    BaseIterator(const BaseIterator&) = default;
+    BaseIterator& operator=(const BaseIterator&) = default;
+
+    reference operator*() const {
+      return static_cast<LeafNode*>(path[top])->get(index - starts[top]);
+    }
+
+    reference operator[](difference_type n) const { return *operator+(n); }
+
+    BaseIterator& operator+=(difference_type n) {
+      Stats::jump();
+      index += n;
+      while (depth && index - starts[top] >= path[top]->size) {
+        top = (top + PATH_SIZE - 1) % PATH_SIZE;
+        --depth;
+        Stats::pop();
+      }
+      if (!depth) {
+        if (!root || index >= root->size) {
+          return *this;
+        }
+        push(root, 0);
+      }
+      go_to_index();
+      return *this;
+    }
+
+    BaseIterator& operator-=(difference_type n) { return operator+=(-n); }
+
+    BaseIterator operator+(difference_type n) const {
+      BaseIterator result = *this;
+      result += n;
+      return result;
+    }
+
+    BaseIterator operator-(difference_type n) const {
+      BaseIterator result = *this;
+      result -= n;
+      return result;
+    }
+
+    BaseIterator& operator++() { return operator+=(1); }
+
+    BaseIterator operator++(int) {
+      BaseIterator copy = *this;
+      operator++();
+      return copy;
+    }
+
+    BaseIterator& operator--() { return operator-=(1); }
+
+    BaseIterator operator--(int) {
+      BaseIterator copy = *this;
+      operator--();
+      return copy;
+    }
+
+    difference_type operator-(const BaseIterator& other) const {
+      return static_cast<difference_type>(index - other.index);
+    }
+
+    std::strong_ordering operator<=>(const BaseIterator& other) const {
+      return index <=> other.index;
+    }
+
+    bool operator==(const BaseIterator& other) const {
+      return index == other.index;
+    }
+
+    friend BaseIterator operator+(difference_type i, const BaseIterator& iter) {
+      return iter + i;
+    }
+  };
+
+  // A lookup that gather() advances one level at a time. The child chosen by
+  // a step is prefetched right away and only read on the next round; a leaf
+  // takes one more round to prefetch the word holding the value.
+  struct Probe {
+    BaseNode* node;
+    size_t k;
+    bool ready = false;
+  };
+
+  Probe probe(size_t i) const {
+    Stats::descent();
+    return {root.get(), i};
+  }
+
+  static bool step(Probe& probe) {
+    if (probe.ready) {
+      return false;
+    }
+    if (is_leaf(probe.node)) {
+      auto leaf = static_cast<LeafNode*>(probe.node);
+      prefetch(leaf->words() + probe.k * leaf->width / WORD_BITS,
+               sizeof(Word) * 2);
+      probe.ready = true;
+      return true;
+    }
+    Stats::step();
+    auto intermediate_node = static_cast<IntermediateNode*>(probe.node);
+    size_t span = child_size(intermediate_node->size);
+    size_t child = probe.k / span;
+    probe.k -= span * child;
+    probe.node = intermediate_node->children[child].get();
+    // The child's size is known without loading it.
+    size_t size = std::min(span, intermediate_node->size - span * child);
+    prefetch(probe.node,
+             size <= LEAF_SIZE ? sizeof(LeafNode) : sizeof(IntermediateNode));
+    return true;
+  }
+
+  static T value(const Probe& probe) {
+    return static_cast<LeafNode*>(probe.node)->get(probe.k);
+  }
+
+  explicit Packed(Rc root) : root(std::move(root)) {}
+
+  BaseIterator<true> begin() const { return {root.get(), 0}; }
+
+  BaseIterator<true> end() const { return {root.get(), size()}; }
+
+  template <std::input_iterator Iter>
+  static Rc build_from_iter(size_t l, size_t r, Iter& iter) {
+    if (l == r) {
+      return Rc{};
+    } else if (r - l <= LEAF_SIZE) {
+      std::array<T, LEAF_SIZE> values;
+      for (size_t i = 0; i < r - l; ++i) {
+        values[i] = *iter++;
+      }
+      return Rc::make_leaf(values.data(), r - l);
+    } else {
+      size_t size = r - l;
+      std::array<Rc, K> children{};
+      for (int i = 0; i < K; ++i) {
+        children[i] =
+            build_from_iter(std::min(r, l + child_size(size) * i),
+                            std::min(r, l + child_size(size) * (i + 1)), iter);
+      }
+      return Rc::make_intermediate(size, std::move(children));
+    }
+  }
+
+  // Filled subtrees of the same size are identical, so every size is built
+  // once and shared.
+  static Rc build_filled(size_t size, const T& fill,
+                         std::unordered_map<size_t, Rc>& built) {
+    if (size == 0) {
+      return Rc{};
+    }
+    auto it = built.find(size);
+    if (it == built.end()) {
+      Rc node;
+      if (size <= LEAF_SIZE) {
+        std::array<T, LEAF_SIZE> values;
+        values.fill(fill);
+        node = Rc::make_leaf(values.data(), size);
+      } else {
+        std::array<Rc, K> children{};
+        for (int i = 0; i < K; ++i) {
+          children[i] =
+              build_filled(std::min(size, child_size(size) * (i + 1)) -
+                               std::min(size, child_size(size) * i),
+                           fill, built);
+        }
+        node = Rc::make_intermediate(size, std::move(children));
+      }
+      it = built.emplace(size, std::move(node)).first;
+    }
+    return it->second;
+  }
+
+  // Only the block holding position i is decoded and re-encoded.
+  template <typename... Args>
+  Rc updated_node(BaseNode* curr, size_t i, Args&&... args) const {
+    if (is_leaf(curr)) {
+      std::array<T, LEAF_SIZE> values;
+      static_cast<LeafNode*>(curr)->decode(values.data());
+      values[i] = T(std::forward<Args>(args)...);
+      return Rc::make_leaf(values.data(), curr->size);
+    }
+    Stats::step();
+    auto intermediate_node = static_cast<IntermediateNode*>(curr);
+    size_t index = which(i, curr->size);
+    i -= child_size(curr->size) * index;
+    Rc updated = updated_node(intermediate_node->children[index].get(), i,
+                              std::forward<Args>(args)...);
+    return Rc::make_intermediate(
+        curr->size,
+        Rc::replaced(intermediate_node->children, index, std::move(updated)));
+  }
+
+  // Path copying that reuses nodes nothing else points to: they are changed
+  // in place, and copying starts at the first shared node. Blocks are always
+  // re-encoded, since the new value may need a wider encoding.
+  template <typename... Args>
+  void update_in_place(Rc& node, size_t i, Args&&... args) {
+    if (node->ref_count != 1 || is_leaf(node.get())) {
+      node = updated_node(node.get(), i, std::forward<Args>(args)...);
+    } else {
+      Stats::step();
+      auto intermediate_node = static_cast<IntermediateNode*>(node.get());
+      size_t child = which(i, node->size);
+      update_in_place(intermediate_node->children[child],
+                      i - child_size(node->size) * child,
+                      std::forward<Args>(args)...);
+    }
+  }
+
+  static bool equal_nodes(BaseNode* a, BaseNode* b) {
+    if (a == b) {
+      return true;
+    }
+    if (!a || !b || a->size != b->size) {
+      return false;
+    }
+    if (is_leaf(a)) {
+      return *static_cast<LeafNode*>(a) == *static_cast<LeafNode*>(b);
+    }
+    auto a_node = static_cast<IntermediateNode*>(a);
+    auto b_node = static_cast<IntermediateNode*>(b);
+    for (int i = 0; i < K; ++i) {
+      if (!equal_nodes(a_node->children[i].get(), b_node->children[i].get())) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Copies positions [l, r) of the subtree at node to out, a whole leaf at a
+  // time.
+  static T* copy_node(BaseNode* node, size_t l, size_t r, T* out) {
+    if (is_leaf(node)) {
+      static_cast<LeafNode*>(node)->decode(l, r, out);
+      return out + (r - l);
+    }
+    auto intermediate_node = static_cast<IntermediateNode*>(node);
+    size_t stride = child_size(node->size);
+    for (size_t child = l / stride; child * stride < r; ++child) {
+      size_t begin = child * stride;
+      out = copy_node(intermediate_node->children[child].get(),
+                      std::max(l, begin) - begin,
+                      std::min(r, begin + stride) - begin, out);
+    }
+    return out;
+  }
+
+  // Node accounting for history: the nodes a version holds and what each of
+  // them takes on the heap.
+  const BaseNode* root_node() const { return root.get(); }
+
+  template <typename F>
+  static void for_each_child(const BaseNode* node, F f) {
+    if (is_leaf(node)) {
+      return;
+    }
+    for (auto& child : static_cast<const IntermediateNode*>(node)->children) {
+      if (child.get()) {
+        f(child.get());
+      }
+    }
+  }
+
+  static size_t node_bytes(const BaseNode* node) {
+    if (!is_leaf(node)) {
+      return sizeof(IntermediateNode);
+    }
+    auto leaf = static_cast<const LeafNode*>(node);
+    return sizeof(LeafNode) +
+           LeafNode::word_count(leaf->size, leaf->width) * sizeof(Word);
+  }
+
+  static Packed filled(size_t count, const T& fill) {
+    std::unordered_map<size_t, Rc> built;
+    return Packed{build_filled(count, fill, built)};
+  }
+
+  template <SizedIterator Iter>
+  static Packed from_iter(Iter first, Iter last) {
+    size_t count = std::ranges::distance(first, last);
+    return Packed{build_from_iter(0, count, first)};
+  }
+
+  template <typename... Args>
+  Packed update(size_t index, Args&&... args) const& {
+    Stats::descent();
+    auto new_root =
+        updated_node(root.get(), index, std::forward<Args>(args)...);
+    return Packed{std::move(new_root)};
+  }
+
+  template <typename... Args>
+  Packed update(size_t index, Args&&... args) && {
+    Stats::descent();
+    update_in_place(root, index, std::forward<Args>(args)...);
+    return std::move(*this);
+  }
+
+  T* copy_to(size_t first, size_t last, T* out) const {
+    return first == last ? out : copy_node(root.get(), first, last, out);
+  }
+
+  bool operator==(const Packed& other) const {
+    return equal_nodes(root.get(), other.root.get());
+  }
+};
+
+}  // namespace base
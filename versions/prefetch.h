@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace base {
+
+static constexpr size_t CACHE_LINE = 64;
+
+// Asks for every cache line of [ptr, ptr + bytes) without waiting for it.
+inline void prefetch(const void* ptr, size_t bytes = 1) {
+  auto first = reinterpret_cast<uintptr_t>(ptr) & ~(CACHE_LINE - 1);
+  auto last = reinterpret_cast<uintptr_t>(ptr) + bytes;
+  for (auto line = first; line < last; line += CACHE_LINE) {
+    __builtin_prefetch(reinterpret_cast<const void*>(line));
+  }
+}
+
+}  // namespace base
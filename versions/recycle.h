@@ -0,0 +1,138 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <new>
+
+namespace base {
+
+// Blocks the Recycler caches of this thread had to take from the allocator
+// because they were empty. Path copying stops adding to it once they are warm.
+inline thread_local size_t fresh_blocks = 0;
+
+// Bytes in blocks the Recycler caches of this thread hold for reuse. They
+// came from the allocator and were not given back, so a heap counter still
+// sees them; subtracting this leaves the bytes held by live nodes.
+inline thread_local size_t cached_bytes = 0;
+
+// Per-thread cache of freed blocks of BYTES bytes. Path copying frees the old
+// path right after allocating the new one, so with a block per tree level in
+// reserve, a loop of pa = pa.update(...) stops calling malloc once it has
+// copied the deepest path. CAPACITY is deeper than any tree; further blocks
+// are freed.
+template <size_t BYTES, size_t ALIGN>
+class Recycler {
+  static constexpr size_t CAPACITY = 64;
+  static constexpr bool OVER_ALIGNED =
+      ALIGN > __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+  static void* fresh() {
+    fresh_blocks += 1;
+    if constexpr (OVER_ALIGNED) {
+      return ::operator new(BYTES, std::align_val_t{ALIGN});
+    } else {
+      return ::operator new(BYTES);
+    }
+  }
+
+  static void release(void* block) {
+    if constexpr (OVER_ALIGNED) {
+      ::operator delete(block, std::align_val_t{ALIGN});
+    } else {
+      ::operator delete(block);
+    }
+  }
+
+  struct Cache {
+    std::array<void*, CAPACITY> blocks;
+    size_t count = 0;
+
+    ~Cache() {
+      while (count) {
+        release(blocks[--count]);
+        cached_bytes -= BYTES;
+      }
+      destroyed = true;
+    }
+  };
+
+  // Nodes can outlive the cache of their thread, in thread-local or static
+  // arrays; those go straight back to the allocator.
+  static inline thread_local bool destroyed = false;
+
+  static Cache* cache() {
+    if (destroyed) [[unlikely]] {
+      return nullptr;
+    }
+    thread_local Cache cache;
+    return &cache;
+  }
+
+ public:
+  static void* allocate() {
+    Cache* cache = Recycler::cache();
+    if (cache && cache->count) {
+      cached_bytes -= BYTES;
+      return cache->blocks[--cache->count];
+    }
+    return fresh();
+  }
+
+  static void deallocate(void* block) {
+    Cache* cache = Recycler::cache();
+    if (cache && cache->count < CAPACITY) {
+      cached_bytes += BYTES;
+      cache->blocks[cache->count++] = block;
+    } else {
+      release(block);
+    }
+  }
+};
+
+template <typename Node>
+using NodeRecycler = Recycler<sizeof(Node), alignof(Node)>;
+
+// Base that routes new and delete of Node through its Recycler.
+template <typename Node>
+struct Recycled {
+  static void* operator new(size_t) { return NodeRecycler<Node>::allocate(); }
+
+  static void operator delete(void* node) {
+    NodeRecycler<Node>::deallocate(node);
+  }
+};
+
+// Allocator for std::allocate_shared, which puts the node and its control
+// block in one recycled allocation.
+template <typename U>
+struct RecyclingAllocator {
+  using value_type = U;
+
+  RecyclingAllocator() = default;
+
+  template <typename V>
+  RecyclingAllocator(const RecyclingAllocator<V>&) {}
+
+  U* allocate(size_t n) {
+    if (n != 1) {
+      return std::allocator<U>().allocate(n);
+    }
+    return static_cast<U*>(NodeRecycler<U>::allocate());
+  }
+
+  void deallocate(U* ptr, size_t n) {
+    if (n != 1) {
+      std::allocator<U>().deallocate(ptr, n);
+    } else {
+      NodeRecycler<U>::deallocate(ptr);
+    }
+  }
+
+  template <typename V>
+  bool operator==(const RecyclingAllocator<V>&) const {
+    return true;
+  }
+};
+
+}  // namespace base
@@ -0,0 +1,451 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "concepts.h"
+#include "prefetch.h"
+
+namespace base {
+
+// Arrays of up to CAPACITY values kept in one flat reference-counted block,
+// so an update is a single allocation and a copy of the block, and a lookup
+// touches one node. Larger arrays are a Tree; edits that cross CAPACITY in
+// either direction switch representation, so equal sizes always share one.
+template <typename T, size_t CAPACITY = 64, typename Tree = EightFold<T>>
+struct Small {
+  // Values follow the header in the same allocation.
+  struct Block {
+    uint32_t ref_count = 1;
+    uint32_t size = 0;
+
+    T* values() {
+      return std::launder(reinterpret_cast<T*>(
+          reinterpret_cast<std::byte*>(this) + VALUES_OFFSET));
+    }
+
+    // Values are constructed one by one and counted in size, so a throwing
+    // constructor leaves a block that destroys exactly what it holds.
+    template <typename... Args>
+    void emplace_back(Args&&... args) {
+      new (values() + size) T(std::forward<Args>(args)...);
+      size += 1;
+    }
+  };
+
+  static_assert(CAPACITY <= UINT32_MAX);
+
+  static constexpr size_t VALUES_OFFSET =
+      (sizeof(Block) + alignof(T) - 1) / alignof(T) * alignof(T);
+  static constexpr size_t ALIGN = std::max(alignof(Block), alignof(T));
+
+  class Rc {
+    Block* ptr = nullptr;
+
+    explicit Rc(Block* raw) : ptr(raw) {}
+
+    static void destroy(Block* block) {
+      std::destroy_n(block->values(), block->size);
+      block->~Block();
+      if constexpr (ALIGN > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        ::operator delete(block, std::align_val_t{ALIGN});
+      } else {
+        ::operator delete(block);
+      }
+    }
+
+   public:
+    Rc() = default;
+
+    Rc(const Rc& rc) : ptr(rc.ptr) {
+      if (ptr) {
+        ptr->ref_count += 1;
+      }
+    }
+
+    Rc(Rc&& rc) noexcept : ptr(std::exchange(rc.ptr, nullptr)) {}
+
+    Rc& operator=(Rc rc) noexcept {
+      std::swap(ptr, rc.ptr);
+      return *this;
+    }
+
+    ~Rc() {
+      if (ptr && --ptr->ref_count == 0) {
+        destroy(ptr);
+      }
+    }
+
+    Block* operator->() const { return ptr; }
+
+    Block* get() const { return ptr; }
+
+    // An empty block with room for count values; none for count == 0.
+    static Rc make(size_t count) {
+      if (count == 0) {
+        return {};
+      }
+      size_t bytes = VALUES_OFFSET + sizeof(T) * count;
+      void* memory;
+      if constexpr (ALIGN > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        memory = ::operator new(bytes, std::align_val_t{ALIGN});
+      } else {
+        memory = ::operator new(bytes);
+      }
+      return Rc{new (memory) Block};
+    }
+  };
+
+  std::variant<Rc, Tree> repr;
+
+  const Rc* flat() const { return std::get_if<Rc>(&repr); }
+
+  const Tree* tree() const { return std::get_if<Tree>(&repr); }
+
+  static T* values_of(const Rc& block) {
+    return block.get() ? block->values() : nullptr;
+  }
+
+  explicit Small(Rc block) : repr(std::move(block)) {}
+
+  explicit Small(Tree tree) : repr(std::move(tree)) {}
+
+  size_t size() const {
+    if (auto block = flat()) {
+      return block->get() ? (*block)->size : 0;
+    }
+    return tree()->size();
+  }
+
+  static constexpr size_t MAX_SIZE = Tree::MAX_SIZE;
+
+  template <bool IsConst>
+  class BaseIterator {
+    using TreeIterator = typename Tree::template BaseIterator<IsConst>;
+
+    // The index is kept in both forms, so comparisons never read the union.
+    // Iterators over a flat array add only a pointer to its values; only
+    // those over a tree build, copy and destroy a tree iterator.
+    size_t index = 0;
+    bool is_flat = true;
+    union {
+      T* values = nullptr;
+      TreeIterator tree;
+    };
+
+    template <bool>
+    friend class BaseIterator;
+    friend struct Small;
+
+    BaseIterator(T* values, size_t index) : index(index), values(values) {}
+
+    BaseIterator(TreeIterator tree, size_t index)
+        : index(index), is_flat(false), tree(std::move(tree)) {}
+
+    void copy_from(const BaseIterator& other) {
+      index = other.index;
+      is_flat = other.is_flat;
+      if (is_flat) {
+        values = other.values;
+      } else {
+        new (&tree) TreeIterator(other.tree);
+      }
+    }
+
+    void destroy() {
+      if (!is_flat) {
+        tree.~TreeIterator();
+      }
+    }
+
+   public:
+    using iterator_category = std::random_access_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = typename TreeIterator::value_type;
+    using reference = typename TreeIterator::reference;
+
+    BaseIterator() {}
+
+    BaseIterator(const BaseIterator& other) { copy_from(other); }
+
+    BaseIterator& operator=(const BaseIterator& other) {
+      if (this != &other) {
+        destroy();
+        copy_from(other);
+      }
+      return *this;
+    }
+
+    ~BaseIterator()
+      requires std::is_trivially_destructible_v<TreeIterator>
+    = default;
+
+    ~BaseIterator() { destroy(); }
+
+    reference operator*() const {
+      if (is_flat) [[likely]] {
+        return values[index];
+      }
+      return *tree;
+    }
+
+    auto operator->() const
+      requires std::is_lvalue_reference_v<reference>
+    {
+      return &operator*();
+    }
+
+    reference operator[](difference_type n) const { return *operator+(n); }
+
+    BaseIterator& operator+=(difference_type n) {
+      index += n;
+      if (!is_flat) [[unlikely]] {
+        tree += n;
+      }
+      return *this;
+    }
+
+    BaseIterator& operator-=(difference_type n) { return operator+=(-n); }
+
+    BaseIterator operator+(difference_type n) const {
+      BaseIterator result = *this;
+      result += n;
+      return result;
+    }
+
+    BaseIterator operator-(difference_type n) const {
+      BaseIterator result = *this;
+      result -= n;
+      return result;
+    }
+
+    BaseIterator& operator++() { return operator+=(1); }
+
+    BaseIterator operator++(int) {
+      BaseIterator copy = *this;
+      operator++();
+      return copy;
+    }
+
+    BaseIterator& operator--() { return operator-=(1); }
+
+    BaseIterator operator--(int) {
+      BaseIterator copy = *this;
+      operator--();
+      return copy;
+    }
+
+    difference_type operator-(const BaseIterator& other) const {
+      return static_cast<difference_type>(index - other.index);
+    }
+
+    std::strong_ordering operator<=>(const BaseIterator& other) const {
+      return index <=> other.index;
+    }
+
+    bool operator==(const BaseIterator& other) const {
+      return index == other.index;
+    }
+
+    friend BaseIterator operator+(difference_type i, const BaseIterator& iter) {
+      return iter + i;
+    }
+
+    explicit operator BaseIterator<true>() {
+      if (is_flat) {
+        return BaseIterator<true>(values, index);
+      }
+      TreeIterator copy = tree;
+      return BaseIterator<true>(
+          static_cast<typename Tree::template BaseIterator<true>>(copy),
+          index);
+    }
+  };
+
+  BaseIterator<true> begin() const {
+    if (auto block = flat()) {
+      return {values_of(*block), 0};
+    }
+    return {tree()->begin(), 0};
+  }
+
+  BaseIterator<true> end() const {
+    if (auto block = flat()) {
+      return {values_of(*block), size()};
+    }
+    return {tree()->end(), size()};
+  }
+
+  // A flat lookup is done as soon as it starts; tree ones step like Tree's.
+  struct Probe {
+    const T* values = nullptr;
+    size_t k = 0;
+    typename Tree::Probe tree{};
+  };
+
+  Probe probe(size_t i) const {
+    if (auto block = flat()) {
+      prefetch(values_of(*block) + i, sizeof(T));
+      return {values_of(*block), i};
+    }
+    return {nullptr, 0, tree()->probe(i)};
+  }
+
+  static bool step(Probe& probe) {
+    return !probe.values && Tree::step(probe.tree);
+  }
+
+  using ValueReference =
+      decltype(Tree::value(std::declval<const typename Tree::Probe&>()));
+
+  static ValueReference value(const Probe& probe) {
+    if (probe.values) {
+      return probe.values[probe.k];
+    }
+    return Tree::value(probe.tree);
+  }
+
+  template <std::input_iterator Iter>
+  static Rc build_from_iter(size_t count, Iter& iter) {
+    Rc block = Rc::make(count);
+    for (size_t i = 0; i < count; ++i) {
+      block->emplace_back(*iter++);
+    }
+    return block;
+  }
+
+  static Small filled(size_t count, const T& fill) {
+    if (count > CAPACITY) {
+      return Small{Tree::filled(count, fill)};
+    }
+    Rc block = Rc::make(count);
+    for (size_t i = 0; i < count; ++i) {
+      block->emplace_back(fill);
+    }
+    return Small{std::move(block)};
+  }
+
+  template <SizedIterator Iter>
+  static Small from_iter(Iter first, Iter last) {
+    size_t count = std::ranges::distance(first, last);
+    if (count > CAPACITY) {
+      return Small{Tree::from_iter(first, last)};
+    }
+    return Small{build_from_iter(count, first)};
+  }
+
+  // The block is copied whole, with the new value in place.
+  template <typename... Args>
+  static Rc updated_block(const Rc& block, size_t i, Args&&... args) {
+    T* old_values = block->values();
+    Rc copy = Rc::make(block->size);
+    for (size_t j = 0; j < block->size; ++j) {
+      if (j == i) {
+        copy->emplace_back(std::forward<Args>(args)...);
+      } else {
+        copy->emplace_back(old_values[j]);
+      }
+    }
+    return copy;
+  }
+
+  template <typename... Args>
+  Small update(size_t index, Args&&... args) const& {
+    if (auto block = flat()) {
+      return Small{updated_block(*block, index, std::forward<Args>(args)...)};
+    }
+    return Small{tree()->update(index, std::forward<Args>(args)...)};
+  }
+
+  // A block nothing else holds is written in place.
+  template <typename... Args>
+  Small update(size_t index, Args&&... args) && {
+    if (auto block = std::get_if<Rc>(&repr)) {
+      if ((*block)->ref_count == 1) {
+        (*block)->values()[index] = T(std::forward<Args>(args)...);
+      } else {
+        *block = updated_block(*block, index, std::forward<Args>(args)...);
+      }
+    } else {
+      auto& tree = std::get<Tree>(repr);
+      tree = std::move(tree).update(index, std::forward<Args>(args)...);
+    }
+    return std::move(*this);
+  }
+
+  template <typename Fn>
+    requires requires(Tree tree, Fn& fn) {
+      std::move(tree).modify_range(0, 0, fn);
+    }
+  Small modify_range(size_t first, size_t last, Fn& fn) && {
+    if (auto block = std::get_if<Rc>(&repr)) {
+      if (first == last) {
+        return std::move(*this);
+      }
+      if ((*block)->ref_count != 1) {
+        T* values = (*block)->values();
+        *block = build_from_iter((*block)->size, values);
+      }
+      T* values = (*block)->values();
+      for (size_t i = first; i < last; ++i) {
+        fn(values[i]);
+      }
+    } else {
+      auto& tree = std::get<Tree>(repr);
+      tree = std::move(tree).modify_range(first, last, fn);
+    }
+    return std::move(*this);
+  }
+
+  // Trees that splice in O(log n) keep doing so while the result stays large;
+  // anything that ends up small, or starts flat, is rebuilt from the values.
+  Small splice(size_t first, size_t last, const Small& inserted) const
+    requires requires(const Tree& tree, size_t i) { tree.splice(i, i, tree); }
+  {
+    size_t count = size() - (last - first) + inserted.size();
+    if (tree() && count > CAPACITY) {
+      if (auto inserted_tree = inserted.tree()) {
+        return Small{tree()->splice(first, last, *inserted_tree)};
+      }
+      T* inserted_values = values_of(*inserted.flat());
+      return Small{tree()->splice(
+          first, last,
+          Tree::from_iter(inserted_values,
+                          inserted_values + inserted.size()))};
+    }
+    std::vector<T> values(count);
+    T* out = copy_to(0, first, values.data());
+    out = inserted.copy_to(0, inserted.size(), out);
+    copy_to(last, size(), out);
+    return from_iter(std::make_move_iterator(values.begin()),
+                     std::make_move_iterator(values.end()));
+  }
+
+  T* copy_to(size_t first, size_t last, T* out) const {
+    if (auto block = flat()) {
+      T* values = values_of(*block);
+      return std::copy(values + first, values + last, out);
+    }
+    return tree()->copy_to(first, last, out);
+  }
+
+  bool operator==(const Small& other) const {
+    if (size() != other.size()) {
+      return false;
+    }
+    if (auto block = flat()) {
+      T* values = values_of(*block);
+      return block->get() == other.flat()->get() ||
+             std::equal(values, values + size(), values_of(*other.flat()));
+    }
+    return *tree() == *other.tree();
+  }
+};
+
+}  // namespace base
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace base::stats {
+
+// Totals of the events counted by stats::Counting. A descent is a walk down to
+// a leaf (a lookup, an iterator jump or an update) and its steps are the levels
+// it goes through; a jump is an iterator operator+= and its pops are the levels
+// it climbs towards the common ancestor of the old and new positions.
+struct Snapshot {
+  uint64_t nodes_allocated = 0;
+  uint64_t nodes_freed = 0;
+  uint64_t descents = 0;
+  uint64_t descent_steps = 0;
+  uint64_t jumps = 0;
+  uint64_t pops = 0;
+
+  int64_t live_nodes() const {
+    return static_cast<int64_t>(nodes_allocated - nodes_freed);
+  }
+
+  double mean_descent_depth() const {
+    return descents ? static_cast<double>(descent_steps) / descents : 0;
+  }
+
+  double mean_pop_distance() const {
+    return jumps ? static_cast<double>(pops) / jumps : 0;
+  }
+
+  Snapshot operator-(const Snapshot& other) const {
+    return {nodes_allocated - other.nodes_allocated,
+            nodes_freed - other.nodes_freed, descents - other.descents,
+            descent_steps - other.descent_steps, jumps - other.jumps,
+            pops - other.pops};
+  }
+};
+
+// Default policy: every hook is empty and Node takes no space, so backends
+// compile to the same code as without instrumentation.
+struct None {
+  struct Node {};
+
+  static void descent() {}
+  static void step() {}
+  static void jump() {}
+  static void pop() {}
+};
+
+// Counts events into per-thread counters, so hot paths never share a cache
+// line. snapshot() sums the counters of all threads, including exited ones.
+class Counting {
+  struct Counters {
+    std::atomic<uint64_t> nodes_allocated = 0;
+    std::atomic<uint64_t> nodes_freed = 0;
+    std::atomic<uint64_t> descents = 0;
+    std::atomic<uint64_t> descent_steps = 0;
+    std::atomic<uint64_t> jumps = 0;
+    std::atomic<uint64_t> pops = 0;
+
+    void add_to(Snapshot& snapshot) const {
+      auto relaxed = std::memory_order_relaxed;
+      snapshot.nodes_allocated += nodes_allocated.load(relaxed);
+      snapshot.nodes_freed += nodes_freed.load(relaxed);
+      snapshot.descents += descents.load(relaxed);
+      snapshot.descent_steps += descent_steps.load(relaxed);
+      snapshot.jumps += jumps.load(relaxed);
+      snapshot.pops += pops.load(relaxed);
+    }
+  };
+
+  struct Registry {
+    std::mutex mutex;
+    std::vector<Counters*> threads;
+    Snapshot exited;
+    // Events from destructors that run after the thread's own counters are
+    // gone. Several exiting threads may race on it and lose counts.
+    Counters late;
+  };
+
+  // Never freed, so that counting keeps working during static destruction.
+  static Registry& registry() {
+    static Registry* registry = new Registry;
+    return *registry;
+  }
+
+  struct Owner {
+    Counters* counters = new Counters;
+
+    Owner() {
+      std::lock_guard lock(registry().mutex);
+      registry().threads.push_back(counters);
+    }
+
+    ~Owner() {
+      {
+        std::lock_guard lock(registry().mutex);
+        auto& threads = registry().threads;
+        counters->add_to(registry().exited);
+        threads.erase(std::find(threads.begin(), threads.end(), counters));
+      }
+      current = &registry().late;
+      delete counters;
+    }
+  };
+
+  static inline thread_local Counters* current = nullptr;
+
+  static Counters& local() {
+    if (!current) [[unlikely]] {
+      thread_local Owner owner;
+      current = owner.counters;
+    }
+    return *current;
+  }
+
+  // Only the owning thread writes its counters; the atomics just let
+  // snapshot() read them concurrently.
+  static void bump(std::atomic<uint64_t>& counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+  }
+
+ public:
+  struct Node {
+    Node() { bump(local().nodes_allocated); }
+
+    ~Node() { bump(local().nodes_freed); }
+  };
+
+  static void descent() { bump(local().descents); }
+  static void step() { bump(local().descent_steps); }
+  static void jump() { bump(local().jumps); }
+  static void pop() { bump(local().pops); }
+
+  static Snapshot snapshot() {
+    auto& registry = Counting::registry();
+    std::lock_guard lock(registry.mutex);
+    Snapshot snapshot = registry.exited;
+    registry.late.add_to(snapshot);
+    for (auto counters : registry.threads) {
+      counters->add_to(snapshot);
+    }
+    return snapshot;
+  }
+};
+
+}  // namespace base::stats
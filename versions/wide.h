@@ -0,0 +1,630 @@
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <unordered_map>
+#include <utility>
+
+#include "concepts.h"
+#include "prefetch.h"
+#include "recycle.h"
+#include "stats.h"
+
+namespace base {
+
+// Tree of cache-line-aligned nodes two lines wide: intermediate nodes hold as
+// many children as fit, and the bottom level holds the values themselves, so
+// a lookup touches one node per level and no separate leaf.
+template <typename T, typename Size = uint32_t,
+          typename Stats = stats::None>
+struct Wide {
+  static constexpr size_t NODE_BYTES = 2 * CACHE_LINE;
+
+  struct BaseNode {
+    Size size;
+    uint32_t ref_count = 1;
+    [[no_unique_address]] typename Stats::Node tracker{};
+  };
+
+  class Rc;
+
+  // Leaves reach their values through data. Inline leaves point it right past
+  // their header, within the same two cache lines; adopted leaves point into
+  // a caller's buffer, which they keep alive together.
+  struct LeafNode : BaseNode {
+    T* data = nullptr;
+
+    T* values() const { return data; }
+
+    bool is_inline() const {
+      return reinterpret_cast<const std::byte*>(data) ==
+             reinterpret_cast<const std::byte*>(this) + VALUES_OFFSET;
+    }
+
+    // Values are constructed one by one and counted in size, so a throwing
+    // constructor leaves a leaf that destroys exactly what it holds.
+    template <typename... Args>
+    void emplace_back(Args&&... args) {
+      new (data + this->size) T(std::forward<Args>(args)...);
+      this->size += 1;
+    }
+  };
+
+  struct AdoptedLeaf : LeafNode {
+    std::shared_ptr<void> owner;
+  };
+
+  static_assert(alignof(T) <= CACHE_LINE);
+
+  static constexpr size_t VALUES_OFFSET =
+      (sizeof(LeafNode) + alignof(T) - 1) / alignof(T) * alignof(T);
+  static constexpr size_t K =
+      (NODE_BYTES - sizeof(BaseNode)) / sizeof(BaseNode*);
+  static constexpr size_t LEAF_SIZE =
+      std::max<size_t>((NODE_BYTES - VALUES_OFFSET) / sizeof(T), 1);
+  static constexpr size_t LEAF_BYTES =
+      std::max(NODE_BYTES, VALUES_OFFSET + sizeof(T) * LEAF_SIZE);
+  static constexpr int B = std::bit_width(K - 1);
+
+  struct alignas(CACHE_LINE) IntermediateNode : BaseNode,
+                                               Recycled<IntermediateNode> {
+    std::array<Rc, K> children;
+
+    IntermediateNode(size_t size, std::array<Rc, K> c)
+        : BaseNode(size), children(std::move(c)) {}
+  };
+
+  class Rc {
+   private:
+    BaseNode* ptr = nullptr;
+
+    Rc(BaseNode* raw) : ptr(raw) {}
+
+   public:
+    Rc(const Rc& rc) : ptr(rc.ptr) {
+      if (!ptr) {
+        return;
+      }
+      ptr->ref_count += 1;
+    }
+
+    Rc(Rc&& rc) noexcept : ptr(rc.ptr) { rc.ptr = nullptr; }
+
+    void swap(Rc& rc) { std::swap(ptr, rc.ptr); }
+
+    Rc& operator=(const Rc& rc) {
+      Rc{rc}.swap(*this);
+      return *this;
+    }
+
+    Rc& operator=(Rc&& rc) noexcept {
+      Rc{std::move(rc)}.swap(*this);
+      return *this;
+    }
+
+    ~Rc() {
+      if (!ptr) {
+        return;
+      }
+      ptr->ref_count -= 1;
+      if (ptr->ref_count == 0) {
+        if (is_leaf(ptr)) {
+          destroy_leaf(static_cast<LeafNode*>(ptr));
+        } else {
+          delete static_cast<IntermediateNode*>(ptr);
+        }
+      }
+    }
+
+    BaseNode* operator->() const { return ptr; }
+
+    BaseNode& operator*() const { return *ptr; }
+
+    BaseNode* get() const { return ptr; }
+
+    LeafNode* leaf() const { return static_cast<LeafNode*>(ptr); }
+
+    static Rc make_leaf() {
+      void* memory = Recycler<LEAF_BYTES, CACHE_LINE>::allocate();
+      auto leaf = new (memory) LeafNode{{0}};
+      leaf->data = reinterpret_cast<T*>(static_cast<std::byte*>(memory) +
+                                        VALUES_OFFSET);
+      return {leaf};
+    }
+
+    static Rc make_adopted(T* data, size_t size, std::shared_ptr<void> owner) {
+      return {new AdoptedLeaf{{BaseNode(size), data}, std::move(owner)}};
+    }
+
+   private:
+    static void destroy_leaf(LeafNode* leaf) {
+      if (!leaf->is_inline()) {
+        delete static_cast<AdoptedLeaf*>(leaf);
+        return;
+      }
+      std::destroy_n(leaf->values(), leaf->size);
+      leaf->~LeafNode();
+      Recycler<LEAF_BYTES, CACHE_LINE>::deallocate(leaf);
+    }
+
+   public:
+
+    // children with the one at index swapped for child. The pointers are
+    // copied as a block and only the children kept gain a reference, instead
+    // of copying each Rc and then releasing the replaced one.
+    static std::array<Rc, K> replaced(const std::array<Rc, K>& children,
+                                      size_t index, Rc child) {
+      std::array<Rc, K> result;
+      for (size_t j = 0; j < K; ++j) {
+        result[j].ptr = children[j].ptr;
+      }
+      for (size_t j = 0; j < K; ++j) {
+        if (j != index && result[j].ptr) {
+          result[j].ptr->ref_count += 1;
+        }
+      }
+      result[index].ptr = std::exchange(child.ptr, {});
+      return result;
+    }
+
+    static Rc make_intermediate(size_t size, std::array<Rc, K> c) {
+      return {new IntermediateNode(size, std::move(c))};
+    }
+
+    Rc() = default;
+  };
+
+  Rc root;
+
+  size_t size() const { return root.get() ? root->size : 0; }
+
+  static constexpr size_t MAX_SIZE = std::numeric_limits<Size>::max();
+
+  static bool is_leaf(const BaseNode* node) { return node->size <= LEAF_SIZE; }
+
+  // Children cover whole leaves, so only the last leaf of a node is partial.
+  static size_t child_size(size_t n) {
+    const size_t span = LEAF_SIZE * K;
+    return (n / span + (n % span != 0)) * LEAF_SIZE;
+  }
+
+  static size_t which(size_t i, size_t n) { return i / child_size(n); }
+
+  template <bool IsConst>
+  class BaseIterator {
+    // As in MySharedPtr, only the deepest PATH_SIZE nodes of the path are
+    // kept, in a ring, each with the index of its first value. A jump past
+    // them descends again from the root.
+    static const size_t PATH_SIZE = 8;
+
+    BaseNode* root = nullptr;
+    size_t index = 0;
+    std::array<BaseNode*, PATH_SIZE> path{};
+    std::array<Size, PATH_SIZE> starts{};
+    uint8_t top = 0;
+    uint8_t depth = 0;
+
+    friend struct Wide;
+
+    void push(BaseNode* node, size_t start) {
+      top = (top + 1) % PATH_SIZE;
+      path[top] = node;
+      starts[top] = start;
+      depth += depth < PATH_SIZE;
+    }
+
+    void go_to_index() {
+      Stats::descent();
+      while (!is_leaf(path[top])) {
+        Stats::step();
+        auto intermediate_node = static_cast<IntermediateNode*>(path[top]);
+        size_t child = which(index - starts[top], intermediate_node->size);
+        push(intermediate_node->children[child].get(),
+             starts[top] + child_size(intermediate_node->size) * child);
+      }
+    }
+
+    BaseIterator(BaseNode* root, size_t index) : root(root), index(index) {
+      if (root && index < root->size) {
+        push(root, 0);
+        go_to_index();
+      }
+    }
+
+   public:
+    using iterator_category = std::random_access_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = std::conditional_t<IsConst, const T, T>;
+    using pointer = value_type*;
+    using reference = value_type&;
+
+    BaseIterator() = default;
+    BaseIterator(const BaseIterator&) = default;
+    BaseIterator& operator=(const BaseIterator&) = default;
+
+    reference operator*() const {
+      return static_cast<LeafNode*>(path[top])->values()[index - starts[top]];
+    }
+
+    pointer operator->() const {
+      return &operator*();
+    }
+
+    reference operator[](difference_type n) const { return *operator+(n); }
+
+    BaseIterator& operator+=(difference_type n) {
+      Stats::jump();
+      index += n;
+      while (depth && index - starts[top] >= path[top]->size) {
+        top = (top + PATH_SIZE - 1) % PATH_SIZE;
+        --depth;
+        Stats::pop();
+      }
+      if (!depth) {
+        if (!root || index >= root->size) {
+          return *this;
+        }
+        push(root, 0);
+      }
+      go_to_index();
+      return *this;
+    }
+
+    BaseIterator& operator-=(difference_type n) { return operator+=(-n); }
+
+    BaseIterator operator+(difference_type n) const {
+      BaseIterator result = *this;
+      result += n;
+      return result;
+    }
+
+    BaseIterator operator-(difference_type n) const {
+      BaseIterator result = *this;
+      result -= n;
+      return result;
+    }
+
+    BaseIterator& operator++() { return operator+=(1); }
+
+    BaseIterator operator++(int) {
+      BaseIterator copy = *this;
+      operator++();
+      return copy;
+    }
+
+    BaseIterator& operator--() { return operator-=(1); }
+
+    BaseIterator operator--(int) {
+      BaseIterator copy = *this;
+      operator--();
+      return copy;
+    }
+
+    difference_type operator-(const BaseIterator& other) const {
+      return static_cast<difference_type>(index - other.index);
+    }
+
+    std::strong_ordering operator<=>(const BaseIterator& other) const {
+      return index <=> other.index;
+    }
+
+    bool operator==(const BaseIterator& other) const {
+      return index == other.index;
+    }
+
+    friend BaseIterator operator+(difference_type i, const BaseIterator& iter) {
+      return iter + i;
+    }
+  };
+
+  // A lookup that gather() advances one level at a time. The child chosen by
+  // a step is prefetched right away and only read on the next round.
+  struct Probe {
+    BaseNode* node;
+    size_t k;
+  };
+
+  Probe probe(size_t i) const {
+    Stats::descent();
+    return {root.get(), i};
+  }
+
+  static bool step(Probe& probe) {
+    if (is_leaf(probe.node)) {
+      return false;
+    }
+    Stats::step();
+    auto intermediate_node = static_cast<IntermediateNode*>(probe.node);
+    size_t child = which(probe.k, intermediate_node->size);
+    probe.k -= child_size(intermediate_node->size) * child;
+    probe.node = intermediate_node->children[child].get();
+    prefetch(probe.node, NODE_BYTES);
+    return true;
+  }
+
+  static const T& value(const Probe& probe) {
+    return static_cast<LeafNode*>(probe.node)->values()[probe.k];
+  }
+
+  explicit Wide(Rc root) : root(std::move(root)) {}
+
+  BaseIterator<true> begin() const { return {root.get(), 0}; }
+
+  BaseIterator<true> end() const { return {root.get(), size()}; }
+
+  template <std::input_iterator Iter>
+  static Rc build_from_iter(size_t l, size_t r, Iter& iter) {
+    if (l == r) {
+      return Rc{};
+    } else if (r - l <= LEAF_SIZE) {
+      auto node = Rc::make_leaf();
+      for (size_t i = l; i < r; ++i) {
+        node.leaf()->emplace_back(*iter++);
+      }
+      return node;
+    } else {
+      size_t size = r - l;
+      std::array<Rc, K> children{};
+      for (size_t i = 0; i < K; ++i) {
+        children[i] =
+            build_from_iter(std::min(r, l + child_size(size) * i),
+                            std::min(r, l + child_size(size) * (i + 1)), iter);
+      }
+      return Rc::make_intermediate(size, std::move(children));
+    }
+  }
+
+  static Rc build_adopted(size_t l, size_t r, T* data,
+                          const std::shared_ptr<void>& owner) {
+    if (l == r) {
+      return Rc{};
+    } else if (r - l <= LEAF_SIZE) {
+      return Rc::make_adopted(data + l, r - l, owner);
+    } else {
+      size_t size = r - l;
+      std::array<Rc, K> children{};
+      for (size_t i = 0; i < K; ++i) {
+        children[i] = build_adopted(std::min(r, l + child_size(size) * i),
+                                    std::min(r, l + child_size(size) * (i + 1)),
+                                    data, owner);
+      }
+      return Rc::make_intermediate(size, std::move(children));
+    }
+  }
+
+  // Filled subtrees of the same size are identical, so every size is built
+  // once and shared.
+  static Rc build_filled(size_t size, const T& fill,
+                         std::unordered_map<size_t, Rc>& built) {
+    if (size == 0) {
+      return Rc{};
+    }
+    auto it = built.find(size);
+    if (it == built.end()) {
+      Rc node;
+      if (size <= LEAF_SIZE) {
+        node = Rc::make_leaf();
+        for (size_t i = 0; i < size; ++i) {
+          node.leaf()->emplace_back(fill);
+        }
+      } else {
+        std::array<Rc, K> children{};
+        for (size_t i = 0; i < K; ++i) {
+          children[i] =
+              build_filled(std::min(size, child_size(size) * (i + 1)) -
+                               std::min(size, child_size(size) * i),
+                           fill, built);
+        }
+        node = Rc::make_intermediate(size, std::move(children));
+      }
+      it = built.emplace(size, std::move(node)).first;
+    }
+    return it->second;
+  }
+
+  // The leaf holding position i is copied whole, with the new value in place.
+  template <typename... Args>
+  Rc updated_node(BaseNode* curr, size_t i, Args&&... args) const {
+    if (is_leaf(curr)) {
+      auto old_values = static_cast<LeafNode*>(curr)->values();
+      auto node = Rc::make_leaf();
+      for (size_t j = 0; j < curr->size; ++j) {
+        if (j == i) {
+          node.leaf()->emplace_back(std::forward<Args>(args)...);
+        } else {
+          node.leaf()->emplace_back(old_values[j]);
+        }
+      }
+      return node;
+    }
+    Stats::step();
+    auto intermediate_node = static_cast<IntermediateNode*>(curr);
+    size_t child = which(i, curr->size);
+    i -= child_size(curr->size) * child;
+    Rc updated = updated_node(intermediate_node->children[child].get(), i,
+                              std::forward<Args>(args)...);
+    return Rc::make_intermediate(
+        curr->size,
+        Rc::replaced(intermediate_node->children, child, std::move(updated)));
+  }
+
+  // Path copying that reuses nodes nothing else points to: they are changed
+  // in place, and copying starts at the first shared node.
+  template <typename... Args>
+  void update_in_place(Rc& node, size_t i, Args&&... args) {
+    if (node->ref_count != 1) {
+      node = updated_node(node.get(), i, std::forward<Args>(args)...);
+    } else if (is_leaf(node.get())) {
+      node.leaf()->values()[i] = T(std::forward<Args>(args)...);
+    } else {
+      Stats::step();
+      auto intermediate_node = static_cast<IntermediateNode*>(node.get());
+      size_t child = which(i, node->size);
+      update_in_place(intermediate_node->children[child],
+                      i - child_size(node->size) * child,
+                      std::forward<Args>(args)...);
+    }
+  }
+
+  // Replaces a shared node with a copy that only this version points to. The
+  // copy shares the children, which are copied in turn when written.
+  static void own(Rc& node) {
+    if (node->ref_count == 1) {
+      return;
+    }
+    if (is_leaf(node.get())) {
+      auto old_values = node.leaf()->values();
+      auto copy = Rc::make_leaf();
+      for (size_t j = 0; j < node->size; ++j) {
+        copy.leaf()->emplace_back(old_values[j]);
+      }
+      node = std::move(copy);
+    } else {
+      auto intermediate_node = static_cast<IntermediateNode*>(node.get());
+      node = Rc::make_intermediate(node->size, intermediate_node->children);
+    }
+  }
+
+  // Calls fn on the values at positions [l, r) of node, in order, a leaf at a
+  // time.
+  template <typename Fn>
+  static void modify_node(Rc& node, size_t l, size_t r, Fn& fn) {
+    own(node);
+    if (is_leaf(node.get())) {
+      auto values = node.leaf()->values();
+      for (size_t j = l; j < r; ++j) {
+        fn(values[j]);
+      }
+      return;
+    }
+    Stats::step();
+    auto intermediate_node = static_cast<IntermediateNode*>(node.get());
+    size_t stride = child_size(node->size);
+    for (size_t child = l / stride; child * stride < r; ++child) {
+      size_t begin = child * stride;
+      modify_node(intermediate_node->children[child],
+                  std::max(l, begin) - begin,
+                  std::min(r, begin + stride) - begin, fn);
+    }
+  }
+
+  static bool equal_nodes(BaseNode* a, BaseNode* b) {
+    if (a == b) {
+      return true;
+    }
+    if (!a || !b || a->size != b->size) {
+      return false;
+    }
+    if (is_leaf(a)) {
+      auto a_values = static_cast<LeafNode*>(a)->values();
+      return std::equal(a_values, a_values + a->size,
+                        static_cast<LeafNode*>(b)->values());
+    }
+    auto a_node = static_cast<IntermediateNode*>(a);
+    auto b_node = static_cast<IntermediateNode*>(b);
+    for (size_t i = 0; i < K; ++i) {
+      if (!equal_nodes(a_node->children[i].get(), b_node->children[i].get())) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Copies positions [l, r) of the subtree at node to out, a whole leaf at a
+  // time.
+  static T* copy_node(BaseNode* node, size_t l, size_t r, T* out) {
+    if (is_leaf(node)) {
+      auto values = static_cast<LeafNode*>(node)->values();
+      return std::copy(values + l, values + r, out);
+    }
+    auto intermediate_node = static_cast<IntermediateNode*>(node);
+    size_t stride = child_size(node->size);
+    for (size_t child = l / stride; child * stride < r; ++child) {
+      size_t begin = child * stride;
+      out = copy_node(intermediate_node->children[child].get(),
+                      std::max(l, begin) - begin,
+                      std::min(r, begin + stride) - begin, out);
+    }
+    return out;
+  }
+
+  // Node accounting for history: the nodes a version holds and what each of
+  // them takes on the heap.
+  const BaseNode* root_node() const { return root.get(); }
+
+  template <typename F>
+  static void for_each_child(const BaseNode* node, F f) {
+    if (is_leaf(node)) {
+      return;
+    }
+    for (auto& child : static_cast<const IntermediateNode*>(node)->children) {
+      if (child.get()) {
+        f(child.get());
+      }
+    }
+  }
+
+  static size_t node_bytes(const BaseNode* node) {
+    if (!is_leaf(node)) {
+      return sizeof(IntermediateNode);
+    }
+    // An adopted buffer goes with the last leaf into it, not with any one.
+    auto leaf = static_cast<const LeafNode*>(node);
+    return leaf->is_inline() ? LEAF_BYTES : sizeof(AdoptedLeaf);
+  }
+
+  static Wide filled(size_t count, const T& fill) {
+    std::unordered_map<size_t, Rc> built;
+    return Wide{build_filled(count, fill, built)};
+  }
+
+  template <SizedIterator Iter>
+  static Wide from_iter(Iter first, Iter last) {
+    size_t count = std::ranges::distance(first, last);
+    return Wide{build_from_iter(0, count, first)};
+  }
+
+  // Leaves point into data instead of holding copies; owner keeps the buffer
+  // alive for as long as any of them does.
+  static Wide adopt(T* data, size_t count, std::shared_ptr<void> owner) {
+    return Wide{build_adopted(0, count, data, owner)};
+  }
+
+  template <typename... Args>
+  Wide update(size_t index, Args&&... args) const& {
+    Stats::descent();
+    auto new_root =
+        updated_node(root.get(), index, std::forward<Args>(args)...);
+    return Wide{std::move(new_root)};
+  }
+
+  template <typename... Args>
+  Wide update(size_t index, Args&&... args) && {
+    Stats::descent();
+    update_in_place(root, index, std::forward<Args>(args)...);
+    return std::move(*this);
+  }
+
+  // Writes through fn into the nodes of [first, last), copying those other
+  // versions share first.
+  template <typename Fn>
+  Wide modify_range(size_t first, size_t last, Fn& fn) && {
+    if (first != last) {
+      Stats::descent();
+      modify_node(root, first, last, fn);
+    }
+    return std::move(*this);
+  }
+
+  T* copy_to(size_t first, size_t last, T* out) const {
+    return first == last ? out : copy_node(root.get(), first, last, out);
+  }
+
+  bool operator==(const Wide& other) const {
+    return equal_nodes(root.get(), other.root.get());
+  }
+};
+
+}  // namespace base